@@ -0,0 +1,1373 @@
+// bench.c - Benchmarks for the bhash library
+// Compile with `make bench` and run `./bench [workload...]` (default: all workloads but `huge`)
+// With -r N, the workloads run N times, -o saves the median and MAD of each
+// measurement as JSON, and -c compares them with a saved baseline (see `make bench-compare`)
+
+#define _DEFAULT_SOURCE // For syscall()
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "bench_keys.h"
+#include "bhash.h"
+#include "bhash_template.h"
+
+//////////////////////////////////////////////////////
+////////////////    Utilities     ////////////////////
+//////////////////////////////////////////////////////
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec/1000000000;
+}
+
+// Failed correctness checks are counted, so the exit status shows them
+static int failures = 0;
+
+__attribute__((format(printf, 1, 2)))
+static void fail(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    printf("Error: ");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+    ++failures;
+}
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15u;
+static uint64_t rng(void) { return keys_rng(&rng_state); }
+
+// Keys look like 16-byte aligned heap pointers
+static inline const void *key_for(size_t i) { return (const void*)(uintptr_t)(16*(i+1)); }
+
+// Hardware counters for each benchmark phase, read with perf_event_open() so
+// that setup isn't counted and the perf tool isn't needed. Counters that the
+// CPU or kernel doesn't support (e.g. in most VMs) are shown as "-". The
+// events are opened separately rather than as a group, so the kernel can
+// multiplex them onto however many counters the CPU has, and the counts are
+// scaled by the fraction of the phase that each one was running.
+static struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    int fd;
+} counters[] = {
+#ifdef __linux__
+#define CACHE_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1},
+    {"instrs", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1},
+    {"L1d-miss", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D), -1},
+    {"LLC-miss", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL), -1},
+    {"dTLB-miss", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB), -1},
+    {"br-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1},
+#endif
+    {NULL, 0, 0, -1},
+};
+static bool have_counters = false;
+
+static void open_counters(void)
+{
+#ifdef __linux__
+    for (size_t i = 0; counters[i].name; i++) {
+        struct perf_event_attr attr = {
+            .size = sizeof(attr),
+            .type = counters[i].type,
+            .config = counters[i].config,
+            .disabled = 1,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+            .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING,
+        };
+        counters[i].fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        have_counters |= counters[i].fd >= 0;
+    }
+#endif
+    if (!have_counters)
+        printf("(Hardware counters are unavailable, see /proc/sys/kernel/perf_event_paranoid)\n");
+}
+
+// Reset the counters and return the time at the start of a phase
+static double phase_start(void)
+{
+#ifdef __linux__
+    for (size_t i = 0; counters[i].name; i++) {
+        if (counters[i].fd < 0) continue;
+        (void)ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+        (void)ioctl(counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    return now();
+}
+
+// Print the per-operation counts for the phase since phase_start()
+static void report_counters(size_t ops)
+{
+#ifdef __linux__
+    if (!have_counters) return;
+    char line[256];
+    int len = snprintf(line, sizeof(line), "%-40s", "");
+    for (size_t i = 0; counters[i].name; i++) {
+        uint64_t values[3] = {0}; // Count, time enabled, time running
+        if (counters[i].fd >= 0) {
+            (void)ioctl(counters[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(counters[i].fd, values, sizeof(values)) != (ssize_t)sizeof(values)) values[2] = 0;
+        }
+        if (values[2] == 0)
+            len += snprintf(line + len, sizeof(line) - (size_t)len, " %s -", counters[i].name);
+        else
+            len += snprintf(line + len, sizeof(line) - (size_t)len, " %s %.2f", counters[i].name,
+                            (double)values[0] * (double)values[1] / (double)values[2] / (double)ops);
+    }
+    printf("%s /op\n", line);
+#else
+    (void)ops;
+#endif
+}
+
+// Every measurement from every run, for saving and comparing with a baseline.
+// Metrics are named "<workload>/<measurement>", since different workloads
+// report measurements with the same name.
+#define MAX_METRICS 256
+#define MAX_RUNS 64
+static struct {
+    char name[96];
+    const char *unit;
+    double values[MAX_RUNS];
+    int count;
+} metrics[MAX_METRICS];
+static int num_metrics = 0;
+static const char *current_workload = "";
+
+static int find_metric(const char *name)
+{
+    int m = 0;
+    while (m < num_metrics && strcmp(metrics[m].name, name) != 0)
+        ++m;
+    return m;
+}
+
+static void record(const char *measurement, double value, const char *unit)
+{
+    char name[sizeof(metrics[0].name)];
+    snprintf(name, sizeof(name), "%s/%s", current_workload, measurement);
+    int m = find_metric(name);
+    if (m == MAX_METRICS) return;
+    if (m == num_metrics) {
+        memcpy(metrics[m].name, name, sizeof(name));
+        metrics[m].unit = unit;
+        ++num_metrics;
+    }
+    if (metrics[m].count < MAX_RUNS)
+        metrics[m].values[metrics[m].count++] = value;
+}
+
+static void report(const char *name, size_t ops, double secs)
+{
+    printf("%-40s %8.2f Mops/s %8.2f ns/op\n", name, (double)ops/secs/1000000, secs*1000000000/(double)ops);
+    report_counters(ops);
+    record(name, secs*1000000000/(double)ops, "ns/op");
+}
+
+//////////////////////////////////////////////////////
+////////////////    Workloads     ////////////////////
+//////////////////////////////////////////////////////
+
+static void bench_basic(void)
+{
+    const size_t n = 1000000;
+    hashmap_t *h = hashmap_new();
+    double start = phase_start();
+    for (size_t i = 0; i < n; i++)
+        (void)hashmap_set(h, key_for(i), key_for(i));
+    report("hashmap_set (1M new keys)", n, now() - start);
+
+    size_t found = 0;
+    start = phase_start();
+    for (size_t i = 0; i < n; i++)
+        found += hashmap_get(h, key_for((i * 2654435761u) % n)) != NULL;
+    report("hashmap_get (hits)", n, now() - start);
+
+    start = phase_start();
+    for (size_t i = 0; i < n; i++)
+        found += hashmap_get(h, key_for(n + i)) != NULL;
+    report("hashmap_get (misses)", n, now() - start);
+
+    start = phase_start();
+    size_t iterated = 0;
+    for (const void *k = NULL; (k = hashmap_next(h, k)); )
+        ++iterated;
+    report("hashmap_next (full iteration)", iterated, now() - start);
+
+    double bytes = (double)(h->capacity*sizeof(hashmap_entry_t) + sizeof(hashmap_t))/(double)n;
+    printf("%-40s %8.2f bytes/entry\n", "", bytes);
+    record("hashmap_t memory (1M keys)", bytes, "bytes/entry");
+
+    if (found != n) fail("found %zu of %zu keys", found, n);
+    hashmap_free(&h);
+}
+
+// Exact LRU built the usual way: a hash map from key to a doubly linked list node
+typedef struct lru_node_s {
+    const void *key;
+    void *value;
+    struct lru_node_s *prev, *next;
+} lru_node_t;
+
+typedef struct {
+    hashmap_t *index;
+    lru_node_t *nodes, head;
+    size_t count, max_count;
+} lru_t;
+
+static void lru_unlink(lru_node_t *n) { n->prev->next = n->next; n->next->prev = n->prev; }
+static void lru_push(lru_t *lru, lru_node_t *n)
+{
+    n->next = lru->head.next;
+    n->prev = &lru->head;
+    lru->head.next->prev = n;
+    lru->head.next = n;
+}
+
+static void *lru_get(lru_t *lru, const void *key)
+{
+    lru_node_t *n = hashmap_get(lru->index, key);
+    if (!n) return NULL;
+    lru_unlink(n);
+    lru_push(lru, n);
+    return n->value;
+}
+
+static void lru_set(lru_t *lru, const void *key, void *value)
+{
+    lru_node_t *n;
+    if (lru->count < lru->max_count) {
+        n = &lru->nodes[lru->count++];
+    } else {
+        n = lru->head.prev;
+        lru_unlink(n);
+        (void)hashmap_set(lru->index, n->key, NULL);
+    }
+    n->key = key;
+    n->value = value;
+    lru_push(lru, n);
+    (void)hashmap_set(lru->index, key, n);
+}
+
+static void bench_cache(void)
+{
+    const size_t universe = 1000000, len = 10000000;
+    const unsigned exponents[] = {80, 99, 120}; // Hundredths
+    const size_t sizes[] = {10000, 100000};
+    for (size_t z = 0; z < sizeof(exponents)/sizeof(exponents[0]); z++) {
+        double s = (double)exponents[z]/100;
+        size_t *trace = zipf_trace(universe, s, len, &rng_state);
+        if (!trace) return;
+        for (size_t c = 0; c < sizeof(sizes)/sizeof(sizes[0]); c++) {
+            char name[64];
+            size_t hits = 0;
+            hashmap_t *cache = hashmap_new_cache(sizes[c]);
+            double start = phase_start();
+            for (size_t t = 0; t < len; t++) {
+                const void *key = key_for(trace[t]);
+                if (hashmap_get(cache, key)) ++hits;
+                else (void)hashmap_set(cache, key, key);
+            }
+            double secs = now() - start;
+            snprintf(name, sizeof(name), "CLOCK cache s=%.2f size=%zu", s, sizes[c]);
+            report(name, len, secs);
+            printf("%-40s %8.2f%% hit rate\n", "", 100*(double)hits/(double)len);
+            // The trace has more keys than fit, so the cache ends up exactly full,
+            // and every key it still has maps to its own value
+            size_t kept = 0, wrong = 0;
+            for (const void *k = NULL; (k = hashmap_next(cache, k)); ++kept)
+                wrong += hashmap_get(cache, k) != k;
+            if (hashmap_length(cache) != sizes[c] || kept != sizes[c] || wrong != 0)
+                fail("a CLOCK cache of %zu kept %zu keys (%zu iterated, %zu wrong)", sizes[c],
+                     hashmap_length(cache), kept, wrong);
+            hashmap_free(&cache);
+
+            hits = 0;
+            lru_t lru = {.index = hashmap_new(), .nodes = calloc(sizes[c], sizeof(lru_node_t)), .max_count = sizes[c]};
+            lru.head.prev = lru.head.next = &lru.head;
+            start = phase_start();
+            for (size_t t = 0; t < len; t++) {
+                const void *key = key_for(trace[t]);
+                if (lru_get(&lru, key)) ++hits;
+                else lru_set(&lru, key, (void*)key);
+            }
+            secs = now() - start;
+            snprintf(name, sizeof(name), "hashmap+list LRU s=%.2f size=%zu", s, sizes[c]);
+            report(name, len, secs);
+            printf("%-40s %8.2f%% hit rate\n", "", 100*(double)hits/(double)len);
+            hashmap_free(&lru.index);
+            free(lru.nodes);
+        }
+        free(trace);
+    }
+}
+
+static uint64_t fake_ms = 0;
+static uint64_t fake_clock(void) { return fake_ms; }
+
+static void bench_expiring(void)
+{
+    // Sessions arrive continuously and expire after 100 "ms", with the clock
+    // ticking every 1000 operations, so ~100K sessions are live at any time
+    const size_t len = 20000000;
+    hashmap_set_clock(fake_clock);
+    hashmap_t *h = hashmap_new_expiring(100);
+    size_t hits = 0, next_session = 0;
+    fake_ms = 0;
+    double start = phase_start();
+    for (size_t t = 0; t < len; t++) {
+        if (t % 1000 == 0) ++fake_ms;
+        if (t % 2 == 0) {
+            (void)hashmap_set(h, key_for(next_session), key_for(next_session));
+            ++next_session;
+        } else {
+            hits += hashmap_get(h, key_for(next_session - 1 - rng() % 200000)) != NULL;
+        }
+    }
+    double secs = now() - start;
+    report("expiring set/get (100ms TTL)", len, secs);
+    printf("%-40s %8.2f%% hit rate, %zu live of %zu slots\n", "", 200*(double)hits/(double)len,
+           hashmap_length(h), h->capacity);
+
+    // Session k was set on step 2k, when the clock read 2k/1000 + 1, so it is
+    // live until the clock reaches 100 "ms" after that
+    size_t wrong = 0;
+    for (size_t k = next_session - 200000; k < next_session; k++)
+        wrong += (hashmap_get(h, key_for(k)) != NULL) != (fake_ms < 2*k/1000 + 1 + 100);
+    if (wrong != 0) fail("%zu of 200000 sessions were wrongly expired or not", wrong);
+    hashmap_free(&h);
+
+    // A clock that jumps by more than 2^32 ms between operations (e.g. after
+    // a long suspend) must expire everything, even the longest TTLs
+    h = hashmap_new_expiring(UINT32_MAX);
+    for (size_t i = 0; i < 100; i++)
+        (void)hashmap_set(h, key_for(i), key_for(i));
+    fake_ms += ((uint64_t)1 << 32) + 1000;
+    size_t found = 0;
+    for (size_t i = 0; i < 100; i++)
+        found += hashmap_get(h, key_for(i)) != NULL;
+    if (found != 0 || hashmap_length(h) != 0)
+        fail("%zu of 100 keys outlived a 2^32 ms clock jump, %zu left", found, hashmap_length(h));
+    hashmap_free(&h);
+    hashmap_set_clock(NULL);
+}
+
+static void bench_persist(void)
+{
+    const size_t n = 4000000;
+    hashmap_t *h = hashmap_new();
+    double start = phase_start();
+    for (size_t i = 0; i < n; i++)
+        (void)hashmap_set(h, key_for(i), key_for(i));
+    report("rebuild with hashmap_set (4M keys)", n, now() - start);
+
+    FILE *f = tmpfile();
+    start = phase_start();
+    if (!f || !hashmap_save(h, f) || fflush(f) != 0) {
+        fail("failed to save hash map");
+        if (f) fclose(f);
+        hashmap_free(&h);
+        return;
+    }
+    report("hashmap_save", n, now() - start);
+
+    rewind(f);
+    start = phase_start();
+    hashmap_t *loaded = hashmap_load(f);
+    report("hashmap_load", n, now() - start);
+    if (!loaded || hashmap_length(loaded) != n)
+        fail("failed to load hash map");
+    fclose(f);
+    if (loaded) hashmap_free(&loaded);
+
+    char path[] = "/tmp/bhash-bench-XXXXXX";
+    int fd = mkstemp(path);
+    f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    bool saved = f && hashmap_save(h, f);
+    if (f) saved = fclose(f) == 0 && saved;
+    else if (fd >= 0) (void)close(fd);
+    if (!saved) {
+        fail("failed to save hash map to %s", path);
+        if (fd >= 0) (void)unlink(path);
+        hashmap_free(&h);
+        return;
+    }
+    start = phase_start();
+    hashmap_t *view = hashmap_open(path);
+    printf("%-40s %8.2f us\n", "hashmap_open (mmap view)", (now() - start)*1000000);
+    if (!view) {
+        fail("failed to open %s", path);
+    } else {
+        size_t found = 0;
+        start = phase_start();
+        for (size_t i = 0; i < n; i++)
+            found += hashmap_get(view, key_for((i * 2654435761u) % n)) != NULL;
+        report("hashmap_get on view (first touch)", n, now() - start);
+        start = phase_start();
+        for (size_t i = 0; i < n; i++)
+            found += hashmap_get(view, key_for((i * 2654435761u) % n)) != NULL;
+        report("hashmap_get on view (warm)", n, now() - start);
+        if (found != 2*n) fail("found %zu of %zu keys", found, 2*n);
+
+        // A view saves as an ordinary map
+        FILE *copy = tmpfile();
+        bool ok = copy && hashmap_save(view, copy) && fflush(copy) == 0;
+        if (copy) rewind(copy);
+        hashmap_t *reloaded = ok ? hashmap_load(copy) : NULL;
+        if (!reloaded || hashmap_length(reloaded) != n || hashmap_get(reloaded, key_for(n/2)) != key_for(n/2))
+            fail("failed to save and reload a view");
+        if (reloaded) hashmap_free(&reloaded);
+        if (copy) fclose(copy);
+        hashmap_free(&view);
+    }
+    (void)unlink(path);
+    hashmap_free(&h);
+}
+
+// Fill a small shared map completely, with keys that all collide so that the
+// free-slot scan runs off the bottom of the table, then check that readers and
+// a new writer can still attach to it. (The pointer hash rotates the low 5 bits
+// of a key out of the slot index, so the keys 1..31 all share main slot 0.)
+static void check_full_shared(void)
+{
+    FILE *f = tmpfile();
+    hashmap_t *h = f ? hashmap_new_shared(fileno(f), 16) : NULL;
+    if (!h) {
+        fail("failed to create shared map");
+        if (f) fclose(f);
+        return;
+    }
+    size_t n = 0;
+    while (n < 31 && hashmap_set(h, (const void*)(uintptr_t)(n + 1), key_for(n)) != HASHMAP_FULL)
+        ++n;
+    hashmap_t *reader = hashmap_attach_shared(fileno(f), false);
+    size_t found = 0;
+    for (size_t i = 0; reader && i < n; i++)
+        found += hashmap_get(reader, (const void*)(uintptr_t)(i + 1)) == key_for(i);
+    if (!reader || n != h->capacity || found != n)
+        fail("a reader found %zu of %zu keys in a full shared map", found, n);
+    if (reader) hashmap_free(&reader);
+
+    hashmap_free(&h);
+    h = hashmap_attach_shared(fileno(f), true);
+    if (!h || hashmap_set(h, (const void*)1, NULL) != key_for(0)
+        || hashmap_set(h, (const void*)(uintptr_t)(n + 1), key_for(n)) != NULL || hashmap_length(h) != n)
+        fail("a new writer couldn't reuse a slot in a full shared map");
+    if (h) hashmap_free(&h);
+    fclose(f);
+}
+
+static void bench_shared(void)
+{
+    const size_t n = 1000000, lookups = 10000000;
+    const int readers = 2;
+    FILE *f = tmpfile();
+    hashmap_t *writer = f ? hashmap_new_shared(fileno(f), n) : NULL;
+    if (!writer) {
+        fail("failed to create shared map");
+        if (f) fclose(f);
+        return;
+    }
+    for (size_t i = 0; i < n; i++)
+        (void)hashmap_set(writer, key_for(i), key_for(i));
+
+    fflush(stdout);
+    for (int r = 0; r < readers; r++) {
+        if (fork() != 0) continue;
+        hashmap_t *reader = hashmap_attach_shared(fileno(f), false);
+        if (!reader) {
+            printf("Error: failed to attach to the shared map\n");
+            fflush(stdout);
+            _exit(1);
+        }
+        size_t found = 0;
+        double start = phase_start();
+        for (size_t i = 0; i < lookups; i++)
+            found += hashmap_get(reader, key_for(rng() % n)) != NULL;
+        char name[64];
+        snprintf(name, sizeof(name), "shared reader %d (%.0f%% found)", r, 100*(double)found/(double)lookups);
+        report(name, lookups, now() - start);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    // Keep updating entries (1000 every millisecond) until the readers are done
+    size_t updates = 0;
+    for (int running = readers; running > 0; ) {
+        for (int i = 0; i < 1000; i++, updates++) {
+            const void *key = key_for(rng() % n);
+            (void)hashmap_set(writer, key, NULL);
+            (void)hashmap_set(writer, key, key);
+        }
+        nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+        for (int status; running > 0 && waitpid(-1, &status, WNOHANG) > 0; --running) {
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                fail("a shared map reader failed");
+        }
+    }
+    printf("%-40s %8zu updates during lookups\n", "shared writer (pop + set pairs)", updates);
+    hashmap_free(&writer);
+    fclose(f);
+    check_full_shared();
+}
+
+static void bench_freeze(void)
+{
+    const size_t n = 1000000;
+    hashmap_t *h = hashmap_new();
+    for (size_t i = 0; i < n; i++)
+        (void)hashmap_set(h, key_for(i), key_for(i));
+
+    for (int frozen = 0; frozen <= 1; frozen++) {
+        if (frozen) {
+            double start = phase_start();
+            if (!hashmap_freeze(h)) {
+                fail("failed to freeze hash map");
+                break;
+            }
+            report("hashmap_freeze (1M keys)", n, now() - start);
+        }
+        size_t found = 0;
+        double start = phase_start();
+        for (size_t i = 0; i < n; i++)
+            found += hashmap_get(h, key_for((i * 2654435761u) % n)) != NULL;
+        report(frozen ? "frozen hashmap_get (hits)" : "hashmap_get (hits)", n, now() - start);
+        start = phase_start();
+        for (size_t i = 0; i < n; i++)
+            found += hashmap_get(h, key_for(n + i)) != NULL;
+        report(frozen ? "frozen hashmap_get (misses)" : "hashmap_get (misses)", n, now() - start);
+        if (found != n) fail("found %zu of %zu keys", found, n);
+        size_t bytes = frozen ? (size_t)h->count*sizeof(hashmap_pair_t) + (size_t)h->extra->buckets*sizeof(uint32_t)
+            : h->capacity*sizeof(hashmap_entry_t);
+        printf("%-40s %8.2f bytes/entry\n", "", (double)bytes/(double)n);
+    }
+    hashmap_free(&h);
+
+    // Freezing an expiring map drops what expired since its last operation
+    hashmap_set_clock(fake_clock);
+    h = hashmap_new_expiring(1000);
+    for (size_t i = 0; i < 1000; i++)
+        (void)hashmap_set_ttl(h, key_for(i), key_for(i), i % 2 ? 1000 : 10);
+    fake_ms += 100;
+    size_t found = 0;
+    if (hashmap_freeze(h)) {
+        for (size_t i = 0; i < 1000; i++)
+            found += hashmap_get(h, key_for(i)) == (i % 2 ? key_for(i) : NULL);
+    }
+    if (found != 1000 || hashmap_length(h) != 500)
+        fail("a frozen expiring map had %zu of 1000 keys right, %zu left", found, hashmap_length(h));
+    hashmap_free(&h);
+    hashmap_set_clock(NULL);
+}
+
+// Walk every chain from its head (the entry in its main slot) to find how many
+// entries a successful lookup checks
+static void report_chains(hashmap_t *h)
+{
+    size_t keys = 0, probes = 0, direct = 0;
+    int longest = 0;
+    for (size_t i = 0; i < h->capacity; i++) {
+        hashmap_entry_t *e = &h->entries[i];
+        if (!e->key || (bhash_hash_pointer(e->key) & (h->capacity-1)) != i) continue;
+        int len = 0;
+        for (; e; e = e->next ? e + e->next : NULL) {
+            ++len;
+            if (!e->value) continue;
+            ++keys;
+            probes += (size_t)len;
+            direct += len == 1;
+        }
+        if (len > longest) longest = len;
+    }
+    printf("%-40s %8.2f probes/hit, %.1f%% in main slot, longest chain %d\n", "",
+           (double)probes/(double)keys, 100*(double)direct/(double)keys, longest);
+}
+
+static void bench_keys(void)
+{
+    const size_t n = 1000000, lookups = 4000000;
+    size_t *uniform = malloc(lookups*sizeof(size_t));
+    size_t *zipf = zipf_trace(n, (double)99/100, lookups, &rng_state);
+    if (!uniform || !zipf) {
+        fail("out of memory");
+        free(uniform);
+        free(zipf);
+        return;
+    }
+    for (size_t i = 0; i < lookups; i++)
+        uniform[i] = rng() % n;
+    for (int d = 0; d < NUM_KEY_DISTRIBUTIONS; d++) {
+        keyset_t ks;
+        if (!keyset_init(&ks, (key_distribution_t)d, n, rng())) {
+            fail("out of memory");
+            break;
+        }
+        char name[64];
+        hashmap_t *h = hashmap_new();
+        double start = phase_start();
+        for (size_t i = 0; i < n; i++)
+            (void)hashmap_set(h, ks.keys[i], ks.keys[i]);
+        snprintf(name, sizeof(name), "%s: hashmap_set", key_distribution_names[d]);
+        report(name, n, now() - start);
+        report_chains(h);
+
+        size_t found = 0;
+        start = phase_start();
+        for (size_t i = 0; i < lookups; i++)
+            found += hashmap_get(h, ks.keys[uniform[i]]) != NULL;
+        snprintf(name, sizeof(name), "%s: hashmap_get (uniform)", key_distribution_names[d]);
+        report(name, lookups, now() - start);
+
+        start = phase_start();
+        for (size_t i = 0; i < lookups; i++)
+            found += hashmap_get(h, ks.keys[zipf[i]]) != NULL;
+        snprintf(name, sizeof(name), "%s: hashmap_get (Zipf s=0.99)", key_distribution_names[d]);
+        report(name, lookups, now() - start);
+        if (found != 2*lookups) fail("found %zu of %zu keys", found, 2*lookups);
+        hashmap_free(&h);
+        keyset_free(&ks);
+    }
+    free(uniform);
+    free(zipf);
+}
+
+// A static map filled to increasing occupancy, up to completely full, to show
+// how chained scatter tables hold up as free slots run out
+static void bench_static(void)
+{
+    const size_t capacity = (size_t)1 << 20, lookups = 4000000;
+    hashmap_entry_t *buffer = malloc(capacity*sizeof(hashmap_entry_t));
+    keyset_t ks;
+    if (!buffer || !keyset_init(&ks, KEYS_MALLOC, capacity + 1, rng())) {
+        free(buffer);
+        return;
+    }
+    hashmap_t h;
+    (void)hashmap_init_static(&h, buffer, capacity);
+    const int percents[] = {50, 75, 90, 100};
+    size_t filled = 0;
+    for (size_t p = 0; p < sizeof(percents)/sizeof(percents[0]); p++) {
+        char name[64];
+        size_t target = capacity*(size_t)percents[p]/100;
+        double start = phase_start();
+        for (size_t i = filled; i < target; i++)
+            (void)hashmap_set(&h, ks.keys[i], ks.keys[i]);
+        snprintf(name, sizeof(name), "static %d%% full: hashmap_set", percents[p]);
+        report(name, target - filled, now() - start);
+        filled = target;
+        report_chains(&h);
+
+        size_t found = 0;
+        start = phase_start();
+        for (size_t i = 0; i < lookups; i++)
+            found += hashmap_get(&h, ks.keys[rng() % filled]) != NULL;
+        snprintf(name, sizeof(name), "static %d%% full: hashmap_get (hits)", percents[p]);
+        report(name, lookups, now() - start);
+        if (found != lookups) fail("found %zu of %zu keys", found, lookups);
+    }
+    if (hashmap_set(&h, ks.keys[capacity], ks.keys[capacity]) != HASHMAP_FULL)
+        fail("a full static map accepted a new key");
+
+    // Replace keys in the full map: each step frees a slot and fills it again
+    const size_t steps = 1000000;
+    double start = phase_start();
+    for (size_t i = 0; i < steps; i++) {
+        size_t j = rng() % capacity;
+        (void)hashmap_pop(&h, ks.keys[j]);
+        (void)hashmap_set(&h, ks.keys[j], ks.keys[j]);
+    }
+    report("static 100% full: hashmap_pop + hashmap_set", steps, now() - start);
+    keyset_free(&ks);
+    free(buffer);
+}
+
+// Keep the optimizer from discarding lookups
+static void *volatile sink_ptr;
+
+// Calls through a function pointer, the way a call into libbhash.so goes
+// through the PLT, so the compiler can't inline or specialize it
+static void *(*volatile library_get)(hashmap_t *h, const void *key) = (hashmap_get);
+
+static void bench_inline(void)
+{
+    const size_t n = 1000, reps = 20000;
+    hashmap_t *h = hashmap_new();
+    for (size_t i = 0; i < n; i++)
+        (void)hashmap_set(h, key_for(i), key_for(i));
+
+    // A small table that stays in cache, so the call overhead dominates
+    size_t found = 0;
+    double start = phase_start();
+    for (size_t r = 0; r < reps; r++)
+        for (size_t i = 0; i < n; i++)
+            found += library_get(h, key_for(i)) != NULL;
+    report("hashmap_get (library call)", n*reps, now() - start);
+
+    start = phase_start();
+    for (size_t r = 0; r < reps; r++)
+        for (size_t i = 0; i < n; i++)
+            found += hashmap_get(h, key_for(i)) != NULL;
+    report("hashmap_get (inline fast path)", n*reps, now() - start);
+
+    if (found != 2*n*reps) fail("found %zu of %zu keys", found, 2*n*reps);
+    hashmap_free(&h);
+}
+
+// Keeps the optimizer from discarding hashes
+static volatile uint64_t hash_sink;
+
+// Byte hashing throughput for each hasher the CPU supports, across key lengths
+static void bench_bytes(void)
+{
+    static const char *hashers[] = {"aes", "crc32c", "portable"};
+    static const size_t lengths[] = {4, 8, 16, 32, 64, 128, 256, 1024};
+    const size_t total_bytes = 256u << 20;
+    unsigned char *buf = malloc(1024 + 64);
+    for (size_t i = 0; i < 1024 + 64; i++)
+        buf[i] = (unsigned char)rng();
+
+    printf("Default hasher: %s\n", bhash_byte_hasher());
+    for (size_t h = 0; h < sizeof(hashers)/sizeof(hashers[0]); h++) {
+        if (!bhash_use_byte_hasher(hashers[h])) {
+            printf("%s: not supported on this CPU\n", hashers[h]);
+            continue;
+        }
+        for (size_t l = 0; l < sizeof(lengths)/sizeof(lengths[0]); l++) {
+            size_t len = lengths[l], n = total_bytes/len/4;
+            uint64_t sum = 0;
+            double start = phase_start();
+            for (size_t i = 0; i < n; i++)
+                sum += bhash_hash_bytes(&buf[i & 63], len);
+            double secs = now() - start;
+            char name[64];
+            snprintf(name, sizeof(name), "%s %zu-byte keys", hashers[h], len);
+            printf("%-40s %8.2f GB/s %8.2f ns/hash\n", name, (double)(n*len)/secs/1000000000, secs*1000000000/(double)n);
+            report_counters(n);
+            hash_sink = sum;
+        }
+    }
+    (void)bhash_use_byte_hasher(NULL);
+    free(buf);
+}
+
+// Inline keys and values with the same hash as hashmap_t
+struct vec2 { double x, y; };
+static inline bool same_key(const void *a, const void *b) { return a == b; }
+BHASH_DEFINE(vecmap, const void*, struct vec2, bhash_hash_pointer, same_key)
+
+static void bench_template(void)
+{
+    const size_t n = 1000000;
+    // hashmap_t values are pointers, so struct values need their own allocations
+    hashmap_t *h = hashmap_new();
+    double start = phase_start();
+    for (size_t i = 0; i < n; i++) {
+        struct vec2 *v = malloc(sizeof(struct vec2));
+        *v = (struct vec2){(double)i, 1};
+        (void)hashmap_set(h, key_for(i), v);
+    }
+    report("hashmap_t set (boxed struct values)", n, now() - start);
+
+    size_t total = 0;
+    start = phase_start();
+    for (size_t i = 0; i < n; i++) {
+        struct vec2 *v = hashmap_get(h, key_for((i * 2654435761u) % n));
+        if (v) total += (size_t)v->y;
+    }
+    report("hashmap_t get (boxed struct values)", n, now() - start);
+    for (const void *k = NULL; (k = hashmap_next(h, k)); )
+        free(hashmap_get(h, k));
+    hashmap_free(&h);
+
+    vecmap_t m = {0};
+    start = phase_start();
+    for (size_t i = 0; i < n; i++)
+        (void)vecmap_set(&m, key_for(i), (struct vec2){(double)i, 1});
+    report("BHASH_DEFINE set (inline struct values)", n, now() - start);
+
+    start = phase_start();
+    for (size_t i = 0; i < n; i++) {
+        struct vec2 *v = vecmap_get(&m, key_for((i * 2654435761u) % n));
+        if (v) total += (size_t)v->y;
+    }
+    report("BHASH_DEFINE get (inline struct values)", n, now() - start);
+    vecmap_free(&m);
+
+    if (total != 2*n) fail("total was %zu", total);
+}
+
+// Log-linear latency histograms, like HdrHistogram: each power of two is split
+// into 16 buckets, so recorded latencies are accurate to within ~6%
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1u << HIST_SUB_BITS)
+typedef struct {
+    uint64_t counts[64*HIST_SUB];
+    uint64_t total, max;
+} histogram_t;
+
+static inline size_t hist_bucket(uint64_t v)
+{
+    if (v < HIST_SUB) return (size_t)v;
+    int e = 63 - __builtin_clzll(v);
+    return ((size_t)(e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) | (size_t)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// The smallest value in a bucket
+static uint64_t hist_value(size_t bucket)
+{
+    if (bucket < HIST_SUB) return bucket;
+    int e = (int)(bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    return ((uint64_t)1 << e) | ((uint64_t)(bucket & (HIST_SUB - 1)) << (e - HIST_SUB_BITS));
+}
+
+static inline void hist_record(histogram_t *hist, uint64_t v)
+{
+    ++hist->counts[hist_bucket(v)];
+    ++hist->total;
+    if (v > hist->max) hist->max = v;
+}
+
+// The value below which `permille` thousandths of the recorded values fall
+static uint64_t hist_percentile(const histogram_t *hist, uint64_t permille)
+{
+    uint64_t rank = hist->total*permille/1000, seen = 0;
+    for (size_t b = 0; b < sizeof(hist->counts)/sizeof(hist->counts[0]); b++) {
+        seen += hist->counts[b];
+        if (seen > rank) return hist_value(b);
+    }
+    return hist->max;
+}
+
+// Latencies are measured in TSC ticks on x86-64 (much cheaper to read than
+// clock_gettime()) and converted to nanoseconds using a calibration run
+#if defined(__x86_64__) && defined(__GNUC__)
+static inline uint64_t ticks(void) { return __builtin_ia32_rdtsc(); }
+#else
+static inline uint64_t ticks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+static double ns_per_tick = 1;
+
+static void report_latency(const char *name, const histogram_t *hist)
+{
+    printf("%-40s p50 %6.0f  p99 %6.0f  p99.9 %7.0f  max %9.0f ns\n", name,
+           (double)hist_percentile(hist, 500)*ns_per_tick, (double)hist_percentile(hist, 990)*ns_per_tick,
+           (double)hist_percentile(hist, 999)*ns_per_tick, (double)hist->max*ns_per_tick);
+}
+
+#define TIMED(hist, expr) do { uint64_t _t = ticks(); expr; hist_record(hist, ticks() - _t); } while (0)
+
+// Check a map that was grown to hold keys 0..n-1 against a plain map with the
+// same entries, then pop every other key from both and check it again
+static void check_grown(hashmap_t *h, size_t n, const char *kind)
+{
+    hashmap_t *ref = hashmap_new();
+    for (size_t i = 0; i < n; i++)
+        (void)hashmap_set(ref, key_for(i), key_for(i));
+    for (size_t live = n; live > n/2; live = n/2) {
+        size_t wrong = 0, iterated = 0;
+        for (size_t i = 0; i < 2*n; i++)
+            wrong += hashmap_get(h, key_for(i)) != hashmap_get(ref, key_for(i));
+        for (const void *k = NULL; (k = hashmap_next(h, k)); ++iterated)
+            wrong += hashmap_get(ref, k) != k;
+        if (wrong != 0 || iterated != live)
+            fail("%s map: %zu lookups disagreed with a plain map, iterated %zu of %zu keys", kind, wrong,
+                 iterated, live);
+        for (size_t i = 0; i < n; i += 2) {
+            (void)hashmap_set(h, key_for(i), NULL);
+            (void)hashmap_set(ref, key_for(i), NULL);
+        }
+    }
+    hashmap_free(&ref);
+}
+
+static void bench_latency(void)
+{
+    double start = now();
+    uint64_t t0 = ticks();
+    while ((now() - start)*1000 < 50) continue;
+    ns_per_tick = (now() - start)*1000000000/(double)(ticks() - t0);
+
+    histogram_t *set = calloc(1, sizeof(histogram_t)), *get = calloc(1, sizeof(histogram_t));
+    histogram_t *timer = calloc(1, sizeof(histogram_t));
+    if (!set || !get || !timer) return;
+    for (int i = 0; i < 1000000; i++)
+        TIMED(timer, (void)0);
+    report_latency("timer overhead (included below)", timer);
+
+    // A map growing from empty, which includes every resize
+    const size_t n = 1000000;
+    hashmap_t *h = hashmap_new();
+    for (size_t i = 0; i < n; i++)
+        TIMED(set, (void)hashmap_set(h, key_for(i), key_for(i)));
+    report_latency("growing: hashmap_set", set);
+    for (size_t i = 0; i < n; i++)
+        TIMED(get, sink_ptr = hashmap_get(h, key_for(rng() % n)));
+    report_latency("growing: hashmap_get (hits)", get);
+    hashmap_free(&h);
+
+    // The same with linear hashing, which splits a bucket at a time instead of
+    // rehashing the whole table
+    memset(set, 0, sizeof(histogram_t));
+    memset(get, 0, sizeof(histogram_t));
+    h = hashmap_new_linear();
+    for (size_t i = 0; i < n; i++)
+        TIMED(set, (void)hashmap_set(h, key_for(i), key_for(i)));
+    report_latency("growing (linear): hashmap_set", set);
+    for (size_t i = 0; i < n; i++)
+        TIMED(get, sink_ptr = hashmap_get(h, key_for(rng() % n)));
+    report_latency("growing (linear): hashmap_get (hits)", get);
+    check_grown(h, n, "linear");
+    hashmap_free(&h);
+
+    // And with a segmented map, where each resize only rehashes one subtable
+    memset(set, 0, sizeof(histogram_t));
+    memset(get, 0, sizeof(histogram_t));
+    h = hashmap_new_segmented();
+    for (size_t i = 0; i < n; i++)
+        TIMED(set, (void)hashmap_set(h, key_for(i), key_for(i)));
+    report_latency("growing (segmented): hashmap_set", set);
+    for (size_t i = 0; i < n; i++)
+        TIMED(get, sink_ptr = hashmap_get(h, key_for(rng() % n)));
+    report_latency("growing (segmented): hashmap_get (hits)", get);
+    check_grown(h, n, "segmented");
+    hashmap_free(&h);
+
+    // A steady-state map of 100K keys, where each step adds a new key, removes
+    // the oldest one, and looks up a random live one
+    const size_t live = 100000, steps = 2000000;
+    memset(set, 0, sizeof(histogram_t));
+    memset(get, 0, sizeof(histogram_t));
+    histogram_t *del = calloc(1, sizeof(histogram_t));
+    if (!del) return;
+    h = hashmap_new();
+    for (size_t i = 0; i < live; i++)
+        (void)hashmap_set(h, key_for(i), key_for(i));
+    for (size_t i = live; i < live + steps; i++) {
+        TIMED(set, (void)hashmap_set(h, key_for(i), key_for(i)));
+        TIMED(del, (void)hashmap_set(h, key_for(i - live), NULL));
+        TIMED(get, sink_ptr = hashmap_get(h, key_for(i - rng() % (live - 1))));
+    }
+    report_latency("churn: hashmap_set (new key)", set);
+    report_latency("churn: hashmap_set (NULL, delete)", del);
+    report_latency("churn: hashmap_get (hits)", get);
+    hashmap_free(&h);
+
+    // Fill a map, then delete 90% of the keys in random order while looking
+    // up keys that are a mix of present and deleted
+    memset(get, 0, sizeof(histogram_t));
+    memset(del, 0, sizeof(histogram_t));
+    h = hashmap_new();
+    for (size_t i = 0; i < n; i++)
+        (void)hashmap_set(h, key_for(i), key_for(i));
+    for (size_t i = 0; i < n - n/10; i++) {
+        TIMED(del, (void)hashmap_set(h, key_for((i * 2654435761u) % n), NULL));
+        TIMED(get, sink_ptr = hashmap_get(h, key_for(rng() % n)));
+    }
+    report_latency("delete-heavy: hashmap_set (NULL)", del);
+    report_latency("delete-heavy: hashmap_get", get);
+    hashmap_free(&h);
+    free(set);
+    free(get);
+    free(del);
+    free(timer);
+}
+
+// Count the bytes the library has allocated, keeping each allocation's size in
+// a header in front of it
+static size_t allocated = 0;
+#define ALLOC_HEADER 16
+
+static void *counting_alloc(size_t size)
+{
+    unsigned char *p = malloc(ALLOC_HEADER + size);
+    if (!p) return NULL;
+    memcpy(p, &size, sizeof(size));
+    allocated += size;
+    return p + ALLOC_HEADER;
+}
+
+static void counting_free(void *ptr)
+{
+    if (!ptr) return;
+    unsigned char *p = (unsigned char*)ptr - ALLOC_HEADER;
+    size_t size;
+    memcpy(&size, p, sizeof(size));
+    allocated -= size;
+    free(p);
+}
+
+static size_t resident_bytes(void)
+{
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    (void)fclose(f);
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+BHASH_DEFINE(ptrmap, const void*, const void*, bhash_hash_pointer, same_key)
+
+static void report_memory(const char *name, size_t n, size_t entries, size_t bytes, size_t rss)
+{
+    printf("%-40s %8.1f bytes/entry allocated", name, (double)bytes/(double)entries);
+    if (rss > 0) printf(" %8.1f bytes/entry RSS", (double)rss/(double)entries);
+    printf(" (n=%zu)\n", n);
+}
+
+// Bytes per live entry at sizes just below and above the points where the
+// table doubles, after deleting half of the entries, and in a copy of the
+// half-empty map. Each size is measured in its own process so that memory
+// freed by earlier sizes can't hide the growth in RSS, and with enough maps
+// that RSS isn't dominated by page granularity. The same keys are also
+// measured in the other layouts: a frozen map, a linear map, a BHASH_DEFINE()
+// map, and (computed, not built) parallel key/value/link arrays and bare key/value pairs.
+static void bench_memory(void)
+{
+    printf("(sizeof(hashmap_entry_t) = %zu, sizeof(hashmap_t) = %zu)\n", sizeof(hashmap_entry_t), sizeof(hashmap_t));
+    hashmap_set_allocator(counting_alloc, counting_free);
+    fflush(stdout);
+    for (int bits = 10; bits <= 20; bits += 2) {
+        for (int above = 0; above <= 1; above++) {
+            pid_t child = fork();
+            if (child < 0) break;
+            if (child > 0) {
+                int status;
+                if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                    fail("the measurement process for 2^%d%s keys failed", bits, above ? "+1" : "-1");
+                continue;
+            }
+            size_t n = above ? ((size_t)1 << bits) + 1 : ((size_t)1 << bits) - 1;
+            size_t copies = n >= ((size_t)1 << 22) ? 1 : ((size_t)1 << 22)/n;
+            hashmap_t **maps = calloc(copies, sizeof(hashmap_t*));
+            if (!maps) _exit(1);
+            char name[64];
+
+            size_t rss = resident_bytes(), bytes = allocated;
+            for (size_t c = 0; c < copies; c++) {
+                maps[c] = hashmap_new();
+                for (size_t i = 0; i < n; i++)
+                    (void)hashmap_set(maps[c], key_for(i), key_for(i));
+            }
+            snprintf(name, sizeof(name), "hashmap_t (capacity %zu)", maps[0]->capacity);
+            report_memory(name, n, copies*n, allocated - bytes, resident_bytes() - rss);
+
+            for (size_t c = 0; c < copies; c++)
+                for (size_t i = 0; i < n; i += 2)
+                    (void)hashmap_set(maps[c], key_for(i), NULL);
+            size_t live = hashmap_length(maps[0]);
+            report_memory("hashmap_t after deleting half", n, copies*live, allocated - bytes, 0);
+
+            bytes = 0;
+            for (size_t c = 0; c < copies; c++) {
+                size_t before = allocated;
+                hashmap_t *copy = hashmap_copy(maps[c]);
+                bytes += allocated - before;
+                hashmap_free(&maps[c]);
+                maps[c] = copy;
+            }
+            report_memory("hashmap_copy of half-empty map", n, copies*live, bytes, 0);
+            for (size_t c = 0; c < copies; c++)
+                hashmap_free(&maps[c]);
+
+            bytes = allocated;
+            hashmap_t *h = hashmap_new();
+            ptrmap_t m = {0};
+            for (size_t i = 0; i < n; i++) {
+                (void)hashmap_set(h, key_for(i), key_for(i));
+                (void)ptrmap_set(&m, key_for(i), key_for(i));
+            }
+            if (hashmap_freeze(h)) report_memory("frozen", n, n, allocated - bytes, 0);
+            hashmap_t *linear = hashmap_new_linear();
+            for (size_t i = 0; i < n; i++)
+                (void)hashmap_set(linear, key_for(i), key_for(i));
+            report_memory("hashmap_new_linear() (slots in use)", n, n, linear->capacity*sizeof(hashmap_entry_t), 0);
+            hashmap_free(&linear);
+            report_memory("BHASH_DEFINE(const void*, const void*)", n, n,
+                          (size_t)m.capacity*sizeof(ptrmap_entry_t), 0);
+            report_memory("parallel key/value/link arrays", n, n,
+                          (size_t)m.capacity*(2*sizeof(void*) + sizeof(int32_t)), 0);
+            report_memory("key/value pairs only", n, n, n*sizeof(hashmap_pair_t), 0);
+            hashmap_free(&h);
+            ptrmap_free(&m);
+            free(maps);
+            fflush(stdout);
+            _exit(0);
+        }
+    }
+    hashmap_set_allocator(malloc, free);
+}
+
+// Maps with more than 2^31 entries, to check that nothing truncates sizes or
+// chain links to 32 bits. This needs about 100GB of memory, so it only runs
+// when named, and $BHASH_HUGE_KEYS can set a different number of keys.
+static void bench_huge(void)
+{
+    const char *env = getenv("BHASH_HUGE_KEYS");
+    size_t n = env ? strtoul(env, NULL, 10) : ((size_t)1 << 31) + ((size_t)1 << 20);
+    hashmap_t *h = hashmap_new();
+    double start = phase_start();
+    for (size_t i = 0; i < n; i++)
+        (void)hashmap_set(h, key_for(i), key_for(i));
+    report("hashmap_set (huge)", n, now() - start);
+    printf("%-40s %zu keys, capacity %zu\n", "", hashmap_length(h), h->capacity);
+
+    size_t found = 0;
+    start = phase_start();
+    for (size_t i = 0; i < n; i++)
+        found += hashmap_get(h, key_for((i * 2654435761u) % n)) == key_for((i * 2654435761u) % n);
+    report("hashmap_get (huge, hits)", n, now() - start);
+
+    size_t iterated = 0;
+    for (const void *k = NULL; (k = hashmap_next(h, k)); )
+        ++iterated;
+
+    start = phase_start();
+    for (size_t i = 0; i < n; i++)
+        (void)hashmap_pop(h, key_for(i));
+    report("hashmap_pop (huge)", n, now() - start);
+
+    if (found != n || iterated != n || hashmap_length(h) != 0)
+        fail("found %zu and iterated %zu of %zu keys, %zu left after popping", found, iterated, n,
+             hashmap_length(h));
+    hashmap_free(&h);
+}
+
+// Check chain links and slot indices past 2^32 without 2^32 keys: a shared
+// map's table is a sparse file, so only the pages these keys touch take memory.
+// The pointer hash rotates the low 5 bits of a key out of the slot index, so
+// the keys (slot << 5) | j for j = 1..31 all have `slot` as their main slot.
+static void bench_wide(void)
+{
+    const size_t capacity = (size_t)1 << 32, per_slot = 8;
+    const size_t slots[] = {1, capacity - 5, capacity/2 + 3, 7, capacity - 1};
+    const size_t num_slots = sizeof(slots)/sizeof(slots[0]), n = num_slots*per_slot;
+#define WIDE_KEY(s, j) ((const void*)(uintptr_t)((slots[s] << 5) | ((j) + 1)))
+    FILE *f = tmpfile();
+    hashmap_t *h = f ? hashmap_new_shared(fileno(f), capacity) : NULL;
+    hashmap_t *reader = h ? hashmap_attach_shared(fileno(f), false) : NULL;
+    if (!h || !reader) {
+        fail("failed to create a shared map with %zu slots", capacity);
+        if (h) hashmap_free(&h);
+        if (f) fclose(f);
+        return;
+    }
+    // Colliding keys go to the top of the table, far from their main slots,
+    // and later keys whose main slots are up there push those entries out
+    double start = phase_start();
+    for (size_t s = 0; s < num_slots; s++)
+        for (size_t j = 0; j < per_slot; j++)
+            (void)hashmap_set(h, WIDE_KEY(s, j), WIDE_KEY(s, j));
+    report("hashmap_set (wide links)", n, now() - start);
+
+    size_t found = 0, missing = 0;
+    for (size_t s = 0; s < num_slots; s++) {
+        for (size_t j = 0; j < per_slot; j++) {
+            found += hashmap_get(h, WIDE_KEY(s, j)) == WIDE_KEY(s, j);
+            found += hashmap_get(reader, WIDE_KEY(s, j)) == WIDE_KEY(s, j);
+        }
+        missing += hashmap_get(h, WIDE_KEY(s, per_slot)) == NULL;
+    }
+    // Popping every other key unlinks entries from the middle of long chains
+    for (size_t s = 0; s < num_slots; s++)
+        for (size_t j = 0; j < per_slot; j += 2)
+            (void)hashmap_pop(h, WIDE_KEY(s, j));
+    for (size_t s = 0; s < num_slots; s++) {
+        for (size_t j = 0; j < per_slot; j++) {
+            const void *expected = (j % 2) ? WIDE_KEY(s, j) : NULL;
+            found += hashmap_get(h, WIDE_KEY(s, j)) == expected;
+            found += hashmap_get(reader, WIDE_KEY(s, j)) == expected;
+        }
+    }
+#undef WIDE_KEY
+    printf("%-40s %zu keys, capacity %zu\n", "", hashmap_length(h), h->capacity);
+    if (found != 4*n || missing != num_slots || hashmap_length(h) != n/2 || h->capacity != capacity)
+        fail("%zu of %zu lookups were right past 2^32 slots, %zu keys left", found + missing,
+             4*n + num_slots, hashmap_length(h));
+    hashmap_free(&reader);
+    hashmap_free(&h);
+    fclose(f);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} workloads[] = {
+    {"basic", bench_basic},
+    {"cache", bench_cache},
+    {"expiring", bench_expiring},
+    {"persist", bench_persist},
+    {"shared", bench_shared},
+    {"freeze", bench_freeze},
+    {"template", bench_template},
+    {"inline", bench_inline},
+    {"bytes", bench_bytes},
+    {"latency", bench_latency},
+    {"memory", bench_memory},
+    {"keys", bench_keys},
+    {"static", bench_static},
+    {"wide", bench_wide},
+    {"huge", bench_huge},
+};
+
+//////////////////////////////////////////////////////
+////////////////  Regression Gate  ///////////////////
+//////////////////////////////////////////////////////
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double median(const double *values, int count)
+{
+    double sorted[MAX_RUNS];
+    memcpy(sorted, values, (size_t)count*sizeof(double));
+    qsort(sorted, (size_t)count, sizeof(double), compare_doubles);
+    return count % 2 ? sorted[count/2] : (sorted[count/2 - 1] + sorted[count/2])/2;
+}
+
+// Median absolute deviation, a measure of noise that ignores outliers
+static double mad(const double *values, int count)
+{
+    double m = median(values, count), deviations[MAX_RUNS];
+    for (int i = 0; i < count; i++)
+        deviations[i] = fabs(values[i] - m);
+    return median(deviations, count);
+}
+
+static bool save_results(const char *path, const char *commit, int runs)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) return false;
+    fprintf(f, "{\n  \"commit\": \"%s\",\n  \"runs\": %d,\n  \"metrics\": {\n", commit, runs);
+    for (int m = 0; m < num_metrics; m++) {
+        fprintf(f, "    \"%s\": {\"unit\": \"%s\", \"median\": %.4f, \"mad\": %.4f}%s\n", metrics[m].name,
+                metrics[m].unit, median(metrics[m].values, metrics[m].count), mad(metrics[m].values, metrics[m].count),
+                m + 1 < num_metrics ? "," : "");
+    }
+    fprintf(f, "  }\n}\n");
+    return fclose(f) == 0;
+}
+
+// Compare the medians with a baseline saved by save_results(). Lower is better
+// for every metric. hashmap_get/hashmap_set times and memory use fail the
+// comparison if they got worse by more than `tolerance` (a fraction) and by
+// more than three (normal-scaled) MADs, so noisy measurements need a bigger
+// change to count as a regression.
+static bool compare_results(const char *path, double tolerance)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        printf("Error: no baseline at %s, so nothing was compared (`make bench-baseline` saves one)\n", path);
+        return false;
+    }
+    bool ok = true;
+    int compared = 0;
+    char line[256], name[96], unit[16], base_commit[64] = "?";
+    double base_median, base_mad;
+    printf("== comparison with %s ==\n", path);
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, " \"commit\": \"%63[^\"]\"", base_commit) == 1) {
+            printf("(baseline commit %s)\n", base_commit);
+            continue;
+        }
+        if (sscanf(line, " \"%95[^\"]\": {\"unit\": \"%15[^\"]\", \"median\": %lf, \"mad\": %lf", name, unit,
+                   &base_median, &base_mad) != 4)
+            continue;
+        int m = find_metric(name);
+        if (m == num_metrics) continue;
+        ++compared;
+        double current = median(metrics[m].values, metrics[m].count);
+        double noise = 3*fmax(base_mad, mad(metrics[m].values, metrics[m].count))*14826/10000;
+        const char *measurement = strchr(name, '/') ? strchr(name, '/') + 1 : name;
+        bool gated = strncmp(measurement, "hashmap_get", 11) == 0 || strncmp(measurement, "hashmap_set", 11) == 0
+            || strcmp(unit, "bytes/entry") == 0;
+        bool regressed = current > base_median + fmax(tolerance*base_median, noise);
+        printf("%-48s %10.2f -> %10.2f %-12s %+6.1f%% %s\n", name, base_median, current, unit,
+               100*(current - base_median)/base_median, !gated ? "" : regressed ? "REGRESSION" : "ok");
+        if (gated && regressed) ok = false;
+    }
+    (void)fclose(f);
+    if (compared == 0) {
+        printf("Error: no measurements in common with %s, so nothing was compared\n", path);
+        return false;
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    const size_t num_workloads = sizeof(workloads)/sizeof(workloads[0]);
+    const char *output = NULL, *baseline = NULL, *commit = "unknown";
+    int runs = 1;
+    double tolerance = 5; // Percent
+    for (int opt; (opt = getopt(argc, argv, "r:o:c:C:t:")) != -1; ) {
+        switch (opt) {
+        case 'r': runs = atoi(optarg); break;
+        case 'o': output = optarg; break;
+        case 'c': baseline = optarg; break;
+        case 'C': commit = optarg; break;
+        case 't': tolerance = atof(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-r runs] [-o results.json] [-C commit] [-c baseline.json] [-t tolerance%%] "
+                    "[workload...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (runs < 1 || runs > MAX_RUNS) {
+        fprintf(stderr, "The number of runs must be between 1 and %d\n", MAX_RUNS);
+        return 1;
+    }
+    open_counters();
+    for (int r = 0; r < runs; r++) {
+        if (runs > 1) printf("==== run %d of %d ====\n", r + 1, runs);
+        for (size_t w = 0; w < num_workloads; w++) {
+            bool selected = (optind >= argc && workloads[w].run != bench_huge);
+            for (int a = optind; a < argc; a++)
+                selected |= strcmp(argv[a], workloads[w].name) == 0;
+            if (!selected) continue;
+            printf("== %s ==\n", workloads[w].name);
+            current_workload = workloads[w].name;
+            workloads[w].run();
+        }
+    }
+    if (output && !save_results(output, commit, runs)) {
+        fprintf(stderr, "Error: failed to write %s\n", output);
+        return 1;
+    }
+    if (baseline && !compare_results(baseline, tolerance/100)) return 1;
+    if (failures > 0) {
+        fprintf(stderr, "%d correctness check%s failed\n", failures, failures == 1 ? "" : "s");
+        return 1;
+    }
+    return 0;
+}
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1
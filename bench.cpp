@@ -0,0 +1,196 @@
+// bench.cpp - Benchmarks for the bhash::map C++ template
+// Compile with `make bench-cpp` and run `./bench-cpp [workload...]` (default: all workloads)
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bhash.hpp"
+
+//////////////////////////////////////////////////////
+////////////////    Utilities     ////////////////////
+//////////////////////////////////////////////////////
+
+static double now(void)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15u;
+static uint64_t rng(void)
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1Du;
+}
+
+static void report(const char *map_name, const char *op, size_t ops, double secs)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%s %s", map_name, op);
+    printf("%-40s %8.2f Mops/s %8.2f ns/op\n", name, (double)ops/secs*1e-6, secs*1e9/(double)ops);
+}
+
+// Keep the optimizer from discarding lookups
+static volatile size_t sink;
+
+// A uniform interface over bhash::map and std::unordered_map for the workloads
+template <class K, class V>
+struct bhash_map {
+    static constexpr const char *name = "bhash::map";
+    bhash::map<K, V> m;
+    void insert(const K &k, V v) { m.emplace(k, std::move(v)); }
+    const V *find(const K &k) const { return m.get(k); }
+    void erase(const K &k) { m.erase(k); }
+};
+
+template <class K, class V>
+struct std_map {
+    static constexpr const char *name = "std::unordered_map";
+    std::unordered_map<K, V> m;
+    void insert(const K &k, V v) { m.emplace(k, std::move(v)); }
+    const V *find(const K &k) const {
+        auto it = m.find(k);
+        return it == m.end() ? nullptr : &it->second;
+    }
+    void erase(const K &k) { m.erase(k); }
+};
+
+// Insert every key, look each one up, look up keys that are missing, then erase them all
+template <class Map, class K, class MakeValue>
+static void run_ops(const std::vector<K> &keys, const std::vector<K> &missing, MakeValue make_value)
+{
+    Map map;
+    double start = now();
+    for (size_t i = 0; i < keys.size(); i++)
+        map.insert(keys[i], make_value(i));
+    report(Map::name, "insert", keys.size(), now() - start);
+
+    size_t found = 0;
+    start = now();
+    for (int rep = 0; rep < 4; rep++)
+        for (const K &k : keys)
+            found += map.find(k) != nullptr;
+    report(Map::name, "lookup (hit)", 4*keys.size(), now() - start);
+
+    start = now();
+    for (const K &k : missing)
+        found += map.find(k) != nullptr;
+    report(Map::name, "lookup (miss)", missing.size(), now() - start);
+
+    start = now();
+    for (const K &k : keys)
+        map.erase(k);
+    report(Map::name, "erase", keys.size(), now() - start);
+    sink = found;
+}
+
+//////////////////////////////////////////////////////
+////////////////    Workloads     ////////////////////
+//////////////////////////////////////////////////////
+
+static void bench_int(void)
+{
+    const size_t n = 1000000;
+    std::vector<uint64_t> keys(n), missing(n);
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = rng() | 1;
+        missing[i] = rng() & ~(uint64_t)1;
+    }
+    auto value = [](size_t i) { return (uint64_t)i; };
+    run_ops<bhash_map<uint64_t, uint64_t>>(keys, missing, value);
+    run_ops<std_map<uint64_t, uint64_t>>(keys, missing, value);
+}
+
+static void bench_string(void)
+{
+    const size_t n = 500000;
+    std::vector<std::string> keys(n), missing(n);
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = "key:" + std::to_string(rng());
+        missing[i] = "missing:" + std::to_string(rng());
+    }
+    auto value = [](size_t i) { return (int)i; };
+    run_ops<bhash_map<std::string, int>>(keys, missing, value);
+    run_ops<std_map<std::string, int>>(keys, missing, value);
+}
+
+static void bench_move_only(void)
+{
+    const size_t n = 500000;
+    std::vector<uint64_t> keys(n), missing(n);
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = rng() | 1;
+        missing[i] = rng() & ~(uint64_t)1;
+    }
+    auto value = [](size_t i) { return std::make_unique<size_t>(i); };
+    run_ops<bhash_map<uint64_t, std::unique_ptr<size_t>>>(keys, missing, value);
+    run_ops<std_map<uint64_t, std::unique_ptr<size_t>>>(keys, missing, value);
+}
+
+// Many short-lived maps, like one per request in a server, with and without
+// a monotonic buffer that is reset after each request
+static void bench_pmr(void)
+{
+    const size_t requests = 20000, n = 200;
+    size_t found = 0;
+    double start = now();
+    for (size_t r = 0; r < requests; r++) {
+        bhash::map<uint64_t, uint64_t> m;
+        for (size_t i = 0; i < n; i++) m[i*r + 1] = i;
+        found += m.size();
+    }
+    report("bhash::map", "per-request (new/delete)", requests*n, now() - start);
+
+    static char buf[1 << 16];
+    start = now();
+    for (size_t r = 0; r < requests; r++) {
+        std::pmr::monotonic_buffer_resource arena(buf, sizeof(buf));
+        bhash::pmr::map<uint64_t, uint64_t> m(&arena);
+        for (size_t i = 0; i < n; i++) m[i*r + 1] = i;
+        found += m.size();
+    }
+    report("bhash::pmr::map", "per-request (monotonic)", requests*n, now() - start);
+
+    start = now();
+    for (size_t r = 0; r < requests; r++) {
+        std::pmr::monotonic_buffer_resource arena(buf, sizeof(buf));
+        std::pmr::unordered_map<uint64_t, uint64_t> m(&arena);
+        for (size_t i = 0; i < n; i++) m[i*r + 1] = i;
+        found += m.size();
+    }
+    report("std::pmr::unordered_map", "per-request (monotonic)", requests*n, now() - start);
+    sink = found;
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} workloads[] = {
+    {"int", bench_int},
+    {"string", bench_string},
+    {"move-only", bench_move_only},
+    {"pmr", bench_pmr},
+};
+
+int main(int argc, char *argv[])
+{
+    for (const auto &w : workloads) {
+        bool selected = (argc <= 1);
+        for (int a = 1; a < argc; a++)
+            selected |= strcmp(argv[a], w.name) == 0;
+        if (!selected) continue;
+        printf("== %s ==\n", w.name);
+        w.run();
+    }
+    return 0;
+}
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1
@@ -0,0 +1,156 @@
+// bench_keys.h - Key distributions for the benchmarks
+// Copyright 2022 Bruce Hill
+// Provided under the MIT license with the Commons Clause
+// See included LICENSE for details.
+
+// Pointer keys from real programs are far from uniformly random, and the
+// pointer hash only rotates the address, so how well a table does depends on
+// where its keys come from. Each distribution here generates `n` distinct keys
+// the way some kind of program would:
+//   - "sequential": small integers cast to pointers (1, 2, 3, ...)
+//   - "malloc": pointers returned by malloc() for objects of mixed sizes
+//   - "arena64": objects carved from an arena at a fixed 64-byte stride
+//   - "interned": strings packed end to end in an interning pool, so the
+//     pointers have irregular strides and no alignment
+//   - "clustered": runs of 16-byte-aligned objects in a few hundred scattered
+//     regions, like objects from several pages or arenas
+// zipf_trace() produces skewed access patterns over any of them. The keys are
+// only used as addresses, never dereferenced. This header is shared by the C
+// and C++ benchmarks.
+
+#pragma once
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum {
+    KEYS_SEQUENTIAL, KEYS_MALLOC, KEYS_ARENA64, KEYS_INTERNED, KEYS_CLUSTERED, NUM_KEY_DISTRIBUTIONS,
+} key_distribution_t;
+
+static const char *const key_distribution_names[NUM_KEY_DISTRIBUTIONS] = {
+    "sequential", "malloc", "arena64", "interned", "clustered",
+};
+
+typedef struct {
+    const void **keys;
+    size_t n;
+    // Memory the keys point into, freed by keyset_free()
+    void *memory;
+    void **allocations;
+} keyset_t;
+
+static inline uint64_t keys_rng(uint64_t *state)
+{
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1Du;
+}
+
+__attribute__((unused)) static void keyset_free(keyset_t *ks)
+{
+    if (ks->allocations) {
+        for (size_t i = 0; i < ks->n; i++)
+            free(ks->allocations[i]);
+        free(ks->allocations);
+    }
+    free(ks->memory);
+    free(ks->keys);
+    memset(ks, 0, sizeof(keyset_t));
+}
+
+// Fill `ks` with `n` keys from the given distribution. Returns false if memory runs out.
+__attribute__((unused)) static bool keyset_init(keyset_t *ks, key_distribution_t dist, size_t n, uint64_t seed)
+{
+    memset(ks, 0, sizeof(keyset_t));
+    ks->keys = (const void**)calloc(n ? n : 1, sizeof(void*));
+    if (!ks->keys) return false;
+    ks->n = n;
+    uint64_t state = seed | 1;
+    switch (dist) {
+    case KEYS_SEQUENTIAL:
+        for (size_t i = 0; i < n; i++)
+            ks->keys[i] = (const void*)(uintptr_t)(i + 1);
+        return true;
+    case KEYS_MALLOC:
+        ks->allocations = (void**)calloc(n ? n : 1, sizeof(void*));
+        if (!ks->allocations) break;
+        for (size_t i = 0; i < n; i++) {
+            if (!(ks->allocations[i] = malloc(16 + keys_rng(&state) % 113))) {
+                keyset_free(ks);
+                return false;
+            }
+            ks->keys[i] = ks->allocations[i];
+        }
+        return true;
+    case KEYS_ARENA64: {
+        // The arena is never touched, so the OS doesn't have to back it with memory
+        unsigned char *arena = (unsigned char*)malloc(64*n + 64);
+        if (!(ks->memory = arena)) break;
+        for (size_t i = 0; i < n; i++)
+            ks->keys[i] = arena + 64*i;
+        return true;
+    }
+    case KEYS_INTERNED: {
+        size_t size = 16*n + 64, used = 0;
+        char *pool = (char*)malloc(size);
+        if (!(ks->memory = pool)) break;
+        for (size_t i = 0; i < n; i++) {
+            int len = snprintf(pool + used, size - used, "sym_%" PRIx32, (uint32_t)(i * 2654435761u));
+            ks->keys[i] = pool + used;
+            used += (size_t)len + 1;
+        }
+        return true;
+    }
+    case KEYS_CLUSTERED: {
+        // Regions are spread over a 47-bit address space, like mmap()ed memory
+        const size_t regions = 256, per_region = n/regions + 1;
+        uintptr_t base = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (i % per_region == 0) base = (uintptr_t)((keys_rng(&state) >> 17) & ~(uint64_t)0xFFF);
+            ks->keys[i] = (const void*)(base + 16*(i % per_region));
+        }
+        return true;
+    }
+    case NUM_KEY_DISTRIBUTIONS: default: break;
+    }
+    keyset_free(ks);
+    return false;
+}
+
+// A trace of item indices in [0,n) drawn from a Zipf distribution with exponent s
+__attribute__((unused)) static size_t *zipf_trace(size_t n, double s, size_t len, uint64_t *state)
+{
+    double *cdf = (double*)malloc(n*sizeof(double));
+    size_t *trace = (size_t*)malloc(len*sizeof(size_t));
+    if (!cdf || !trace) {
+        free(cdf);
+        free(trace);
+        return NULL;
+    }
+    double total = 0;
+    for (size_t i = 0; i < n; i++)
+        cdf[i] = (total += 1/pow((double)(i+1), s));
+    for (size_t t = 0; t < len; t++) {
+        double u = (double)(keys_rng(state) >> 11) * 0x1p-53 * total;
+        size_t lo = 0, hi = n-1;
+        while (lo < hi) {
+            size_t mid = (lo + hi)/2;
+            if (cdf[mid] < u) lo = mid + 1;
+            else hi = mid;
+        }
+        // Scatter ranks so that popular items aren't all adjacent keys
+        trace[t] = (lo * 2654435761u) % n;
+    }
+    free(cdf);
+    return trace;
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1
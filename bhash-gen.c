@@ -0,0 +1,290 @@
+// bhash-gen.c - Generate perfectly hashed constant lookup tables
+// Copyright 2022 Bruce Hill
+// Provided under the MIT license with the Commons Clause
+// See included LICENSE for details.
+
+// Reads lines of "key value" (separated by a tab or spaces) and writes a C
+// header with a `static const` table and a NAME_lookup() function that finds
+// any key with one hash and one comparison, using the same minimal perfect
+// hash construction as hashmap_freeze(). Values are copied verbatim as C
+// initializer expressions. Blank lines and lines starting with '#' are skipped.
+//
+// Usage: bhash-gen [-n name] [-t value_type] [-i] [-o output.h] [input]
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mph.h"
+
+typedef struct {
+    char *key;
+    size_t len;
+    uint64_t int_key;
+    char *value;
+} item_t;
+
+static const char *usage = "Usage: bhash-gen [-n name] [-t value_type] [-i] [-o output.h] [input]\n"
+    "  -n name        Prefix for the generated identifiers (default: table)\n"
+    "  -t value_type  C type of the values (default: const char *)\n"
+    "  -i             Keys are unsigned integers instead of strings\n"
+    "  -o output.h    Write to a file instead of stdout\n";
+
+// Must match the generated NAME_hash()
+static uint64_t hash_string(const char *str, size_t len)
+{
+    uint64_t hash = 0xCBF29CE484222325u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 0x100000001B3u;
+    }
+    return mph_mix(hash);
+}
+
+static void write_string(FILE *out, const char *str, size_t len)
+{
+    fputc('"', out);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)str[i];
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (isprint(c)) fputc(c, out);
+        else fprintf(out, "\\%03o", c);
+    }
+    fputc('"', out);
+}
+
+static bool valid_identifier(const char *name)
+{
+    if (!isalpha((unsigned char)*name) && *name != '_') return false;
+    for (; *name; name++)
+        if (!isalnum((unsigned char)*name) && *name != '_') return false;
+    return true;
+}
+
+static void write_table(FILE *out, const char *name, const char *value_type, bool int_keys,
+                        const item_t *items, const uint32_t *order, const uint32_t *pilots, uint32_t n)
+{
+    uint32_t num_buckets = mph_num_buckets(n);
+    fprintf(out, "// Generated by bhash-gen: do not edit\n"
+            "#pragma once\n\n"
+            "#include <stddef.h>\n"
+            "#include <stdint.h>\n");
+    if (!int_keys) fprintf(out, "#include <string.h>\n");
+    fprintf(out, "\n");
+
+    if (int_keys) fprintf(out, "typedef struct { uint64_t key; %s value; } %s_entry_t;\n\n", value_type, name);
+    else fprintf(out, "typedef struct { const char *key; size_t len; %s value; } %s_entry_t;\n\n", value_type, name);
+
+    fprintf(out, "static const uint32_t %s_pilots[%" PRIu32 "] = {", name, num_buckets);
+    for (uint32_t b = 0; b < num_buckets; b++)
+        fprintf(out, "%s0x%08" PRIX32 "u,", b % 8 == 0 ? "\n    " : " ", pilots[b]);
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "static const %s_entry_t %s_entries[%" PRIu32 "] = {\n", name, name, n > 0 ? n : 1);
+    for (uint32_t slot = 0; slot < n; slot++) {
+        const item_t *item = &items[order[slot]];
+        fprintf(out, "    {");
+        if (int_keys) {
+            fprintf(out, "0x%" PRIX64 "u", item->int_key);
+        } else {
+            write_string(out, item->key, item->len);
+            fprintf(out, ", %zu", item->len);
+        }
+        fprintf(out, ", %s},\n", item->value);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static inline uint64_t %s_mix(uint64_t x)\n"
+            "{\n"
+            "    x ^= x >> 30;\n"
+            "    x *= 0xBF58476D1CE4E5B9u;\n"
+            "    x ^= x >> 27;\n"
+            "    x *= 0x94D049BB133111EBu;\n"
+            "    x ^= x >> 31;\n"
+            "    return x;\n"
+            "}\n\n", name);
+
+    if (!int_keys) {
+        fprintf(out, "static inline uint64_t %s_hash(const char *key, size_t len)\n"
+                "{\n"
+                "    uint64_t hash = 0xCBF29CE484222325u;\n"
+                "    for (size_t i = 0; i < len; i++) {\n"
+                "        hash ^= (unsigned char)key[i];\n"
+                "        hash *= 0x100000001B3u;\n"
+                "    }\n"
+                "    return %s_mix(hash);\n"
+                "}\n\n", name, name);
+    }
+
+    fprintf(out, "static inline uint32_t %s_slot(uint64_t hash)\n"
+            "{\n"
+            "    uint32_t pilot = %s_pilots[(uint32_t)(((hash >> 32) * %" PRIu32 "u) >> 32)];\n"
+            "    if (pilot & 0x80000000u) return pilot & 0x7FFFFFFFu;\n"
+            "    uint32_t x = (uint32_t)%s_mix(hash ^ ((uint64_t)pilot * 0x9E3779B97F4A7C15u));\n"
+            "    return (uint32_t)(((uint64_t)x * %" PRIu32 "u) >> 32);\n"
+            "}\n\n", name, name, num_buckets, name, n);
+
+    const char *empty_check = n == 0 ? "    return NULL;\n" : "";
+    fprintf(out, "// Return a pointer to the value for `key`, or NULL if it is not in the table\n");
+    if (int_keys) {
+        fprintf(out, "static inline %s const *%s_lookup(uint64_t key)\n"
+                "{\n"
+                "%s"
+                "    const %s_entry_t *e = &%s_entries[%s_slot(%s_mix(key))];\n"
+                "    return e->key == key ? &e->value : NULL;\n"
+                "}\n", value_type, name, empty_check, name, name, name, name);
+    } else {
+        fprintf(out, "static inline %s const *%s_lookup(const char *key, size_t len)\n"
+                "{\n"
+                "%s"
+                "    const %s_entry_t *e = &%s_entries[%s_slot(%s_hash(key, len))];\n"
+                "    return e->len == len && memcmp(e->key, key, len) == 0 ? &e->value : NULL;\n"
+                "}\n", value_type, name, empty_check, name, name, name, name);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *name = "table", *value_type = "const char *", *output = NULL;
+    bool int_keys = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:io:h")) != -1) {
+        switch (opt) {
+        case 'n': name = optarg; break;
+        case 't': value_type = optarg; break;
+        case 'i': int_keys = true; break;
+        case 'o': output = optarg; break;
+        case 'h': printf("%s", usage); return 0;
+        default: fprintf(stderr, "%s", usage); return 1;
+        }
+    }
+    if (!valid_identifier(name)) {
+        fprintf(stderr, "bhash-gen: invalid table name: %s\n", name);
+        return 1;
+    }
+
+    FILE *in = stdin;
+    const char *in_name = "<stdin>";
+    if (optind < argc) {
+        in_name = argv[optind];
+        in = fopen(in_name, "r");
+        if (!in) {
+            fprintf(stderr, "bhash-gen: %s: %s\n", in_name, strerror(errno));
+            return 1;
+        }
+    }
+
+    item_t *items = NULL;
+    size_t n = 0, capacity = 0, line_size = 0;
+    char *line = NULL;
+    ssize_t line_len;
+    for (int line_no = 1; (line_len = getline(&line, &line_size, in)) != -1; line_no++) {
+        while (line_len > 0 && (line[line_len-1] == '\n' || line[line_len-1] == '\r'))
+            line[--line_len] = '\0';
+        if (line_len == 0 || line[0] == '#') continue;
+
+        size_t key_len = strcspn(line, " \t");
+        char *value = &line[key_len];
+        value += strspn(value, " \t");
+        if (key_len == 0 || !*value) {
+            fprintf(stderr, "bhash-gen: %s:%d: expected a key and a value\n", in_name, line_no);
+            return 1;
+        }
+        if (n >= INT32_MAX) {
+            fprintf(stderr, "bhash-gen: too many keys\n");
+            return 1;
+        }
+        if (n == capacity) {
+            capacity = capacity ? 2*capacity : 64;
+            items = realloc(items, capacity*sizeof(item_t));
+            if (!items) {
+                fprintf(stderr, "bhash-gen: out of memory\n");
+                return 1;
+            }
+        }
+
+        item_t *item = &items[n++];
+        item->key = strndup(line, key_len);
+        item->len = key_len;
+        item->value = strdup(value);
+        item->int_key = 0;
+        if (!item->key || !item->value) {
+            fprintf(stderr, "bhash-gen: out of memory\n");
+            return 1;
+        }
+        if (int_keys) {
+            char *end;
+            errno = 0;
+            uintmax_t k = strtoumax(item->key, &end, 0);
+            if (errno || *end || item->key[0] == '-' || k > UINT64_MAX) {
+                fprintf(stderr, "bhash-gen: %s:%d: invalid integer key: %s\n", in_name, line_no, item->key);
+                return 1;
+            }
+            item->int_key = (uint64_t)k;
+        }
+    }
+    free(line);
+    if (in != stdin) fclose(in);
+
+    uint32_t count = (uint32_t)n;
+    uint64_t *hashes = malloc(((size_t)count + 1)*sizeof(uint64_t));
+    uint32_t *slots = malloc(((size_t)count + 1)*sizeof(uint32_t));
+    uint32_t *order = malloc(((size_t)count + 1)*sizeof(uint32_t));
+    uint32_t *pilots = malloc((size_t)mph_num_buckets(count)*sizeof(uint32_t));
+    if (!hashes || !slots || !order || !pilots) {
+        fprintf(stderr, "bhash-gen: out of memory\n");
+        return 1;
+    }
+    for (uint32_t i = 0; i < count; i++)
+        hashes[i] = int_keys ? mph_mix(items[i].int_key) : hash_string(items[i].key, items[i].len);
+
+    if (!mph_build(hashes, count, pilots, slots)) {
+        // Either a duplicate key or (vanishingly unlikely) a 64-bit hash collision
+        for (uint32_t i = 0; i < count; i++) {
+            for (uint32_t j = 0; j < i; j++) {
+                if (hashes[i] == hashes[j]) {
+                    fprintf(stderr, "bhash-gen: duplicate key: %s\n", items[i].key);
+                    return 1;
+                }
+            }
+        }
+        fprintf(stderr, "bhash-gen: failed to build a perfect hash\n");
+        return 1;
+    }
+    for (uint32_t i = 0; i < count; i++)
+        order[slots[i]] = i;
+
+    FILE *out = stdout;
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            fprintf(stderr, "bhash-gen: %s: %s\n", output, strerror(errno));
+            return 1;
+        }
+    }
+    write_table(out, name, value_type, int_keys, items, order, pilots, count);
+    if (ferror(out) || (out != stdout && fclose(out) != 0)) {
+        fprintf(stderr, "bhash-gen: failed to write output\n");
+        if (output) remove(output);
+        return 1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        free(items[i].key);
+        free(items[i].value);
+    }
+    free(items);
+    free(hashes);
+    free(slots);
+    free(order);
+    free(pilots);
+    return 0;
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1
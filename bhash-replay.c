@@ -0,0 +1,300 @@
+// bhash-replay.c - Replay operation traces recorded by a -DBHASH_TRACE build
+// Copyright 2022 Bruce Hill
+// Provided under the MIT license with the Commons Clause
+// See included LICENSE for details.
+
+// Usage: bhash-replay [-e engine] [-r repeats] trace.bin
+// Engines:
+//   bhash         hashmap_new() (the default)
+//   cache=N       hashmap_new_cache(N)
+//   linear        hashmap_new_linear()
+//   segmented     hashmap_new_segmented()
+//   expiring=MS   hashmap_new_expiring(MS), with the clock ticking 1ms per 1000 operations
+//   template      a BHASH_DEFINE() map
+// The trace is replayed `repeats` times (default 5) to measure throughput,
+// then once more timing each operation for latency percentiles. Keys and values
+// are synthetic pointers standing in for the recorded ones, so the replay
+// reproduces the access pattern, not the program's key distribution.
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bhash.h"
+#include "bhash_template.h"
+
+static inline bool same_key(const void *a, const void *b) { return a == b; }
+BHASH_DEFINE(tmap, const void*, const void*, bhash_hash_pointer, same_key)
+
+static inline const void *key_for(uint32_t id) { return id ? (const void*)(uintptr_t)(16*(uint64_t)id) : NULL; }
+
+static uint64_t fake_ms = 0;
+static uint64_t fake_clock(void) { return fake_ms; }
+
+//////////////////////////////////////////////////////
+////////////////     Engines      ////////////////////
+//////////////////////////////////////////////////////
+
+static size_t cache_size = 0;
+static uint32_t ttl_ms = 0;
+
+static void *bhash_create(void) { return hashmap_new(); }
+static void *cache_create(void) { return hashmap_new_cache(cache_size); }
+static void *linear_create(void) { return hashmap_new_linear(); }
+static void *segmented_create(void) { return hashmap_new_segmented(); }
+static void *expiring_create(void) { return hashmap_new_expiring(ttl_ms); }
+static const void *bhash_get(void *m, const void *key) { return hashmap_get(m, key); }
+static void bhash_set(void *m, const void *key, const void *value) { (void)hashmap_set(m, key, value); }
+static const void *bhash_next(void *m, const void *key) { return hashmap_next(m, key); }
+static void bhash_clear(void *m) { hashmap_clear(m); }
+static void bhash_destroy(void *m)
+{
+    hashmap_t *h = m;
+    hashmap_free(&h);
+}
+
+static void *tmap_create(void) { return calloc(1, sizeof(tmap_t)); }
+static const void *tmap_lookup(void *m, const void *key)
+{
+    const void **value = tmap_get(m, key);
+    return value ? *value : NULL;
+}
+static void tmap_store(void *m, const void *key, const void *value)
+{
+    if (value) (void)tmap_set(m, key, value);
+    else (void)tmap_remove(m, key);
+}
+static const void *tmap_iterate(void *m, const void *key)
+{
+    tmap_entry_t *e = key ? tmap_find(m, key) : NULL;
+    if (key && !e) return NULL;
+    e = tmap_next(m, e);
+    return e ? e->key : NULL;
+}
+static void tmap_wipe(void *m) { tmap_clear(m); }
+static void tmap_destroy(void *m)
+{
+    tmap_free(m);
+    free(m);
+}
+
+typedef struct {
+    void *(*create)(void);
+    const void *(*get)(void *m, const void *key);
+    void (*set)(void *m, const void *key, const void *value);
+    const void *(*next)(void *m, const void *key);
+    void (*clear)(void *m);
+    void (*destroy)(void *m);
+} engine_t;
+
+static const engine_t bhash_engine = {bhash_create, bhash_get, bhash_set, bhash_next, bhash_clear, bhash_destroy};
+static const engine_t cache_engine = {cache_create, bhash_get, bhash_set, bhash_next, bhash_clear, bhash_destroy};
+static const engine_t linear_engine = {linear_create, bhash_get, bhash_set, bhash_next, bhash_clear, bhash_destroy};
+static const engine_t segmented_engine = {segmented_create, bhash_get, bhash_set, bhash_next, bhash_clear,
+                                         bhash_destroy};
+static const engine_t expiring_engine = {expiring_create, bhash_get, bhash_set, bhash_next, bhash_clear, bhash_destroy};
+static const engine_t template_engine = {tmap_create, tmap_lookup, tmap_store, tmap_iterate, tmap_wipe, tmap_destroy};
+
+//////////////////////////////////////////////////////
+////////////////      Replay      ////////////////////
+//////////////////////////////////////////////////////
+
+typedef struct {
+    uint32_t op, key;
+} record_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec/1000000000;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static long resident_bytes(void)
+{
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    (void)fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Live maps, indexed by their number in the trace
+static void **maps = NULL;
+static uint32_t num_maps = 0;
+
+static void replay_one(const engine_t *engine, record_t r, size_t *hits)
+{
+    uint32_t id = r.op >> HASHMAP_TRACE_MAP_SHIFT;
+    hashmap_trace_op_t op = (hashmap_trace_op_t)(r.op & HASHMAP_TRACE_OP_MASK);
+    if (id >= num_maps) return;
+    if (op == HASHMAP_TRACE_FREE) {
+        if (maps[id]) engine->destroy(maps[id]);
+        maps[id] = NULL;
+        return;
+    }
+    if (!maps[id] && !(maps[id] = engine->create())) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    const void *key = key_for(r.key);
+    switch (op) {
+    case HASHMAP_TRACE_GET: *hits += engine->get(maps[id], key) != NULL; break;
+    case HASHMAP_TRACE_SET: engine->set(maps[id], key, (r.op & HASHMAP_TRACE_NULL) ? NULL : key); break;
+    case HASHMAP_TRACE_NEXT: *hits += engine->next(maps[id], key) != NULL; break;
+    case HASHMAP_TRACE_CLEAR: engine->clear(maps[id]); break;
+    case HASHMAP_TRACE_FREE: break;
+    default: break;
+    }
+}
+
+static void free_maps(const engine_t *engine)
+{
+    for (uint32_t i = 0; i < num_maps; i++) {
+        if (maps[i]) engine->destroy(maps[i]);
+        maps[i] = NULL;
+    }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// The value below which `permille` thousandths of the sorted values fall
+static uint64_t percentile(const uint64_t *sorted, size_t n, size_t permille)
+{
+    size_t i = (n - 1)*permille/1000;
+    return sorted[i];
+}
+
+int main(int argc, char *argv[])
+{
+    const engine_t *engine = &bhash_engine;
+    const char *engine_name = "bhash";
+    int repeats = 5;
+    for (int opt; (opt = getopt(argc, argv, "e:r:")) != -1; ) {
+        switch (opt) {
+        case 'e':
+            engine_name = optarg;
+            if (strcmp(optarg, "bhash") == 0) {
+                engine = &bhash_engine;
+            } else if (strncmp(optarg, "cache=", 6) == 0 && atol(optarg + 6) > 0) {
+                cache_size = (size_t)atol(optarg + 6);
+                engine = &cache_engine;
+            } else if (strcmp(optarg, "linear") == 0) {
+                engine = &linear_engine;
+            } else if (strcmp(optarg, "segmented") == 0) {
+                engine = &segmented_engine;
+            } else if (strncmp(optarg, "expiring=", 9) == 0 && atoi(optarg + 9) > 0) {
+                ttl_ms = (uint32_t)atoi(optarg + 9);
+                engine = &expiring_engine;
+                hashmap_set_clock(fake_clock);
+            } else if (strcmp(optarg, "template") == 0) {
+                engine = &template_engine;
+            } else {
+                fprintf(stderr, "Unknown engine: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r': repeats = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-e bhash|cache=N|linear|segmented|expiring=MS|template] [-r repeats] trace.bin\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || repeats < 1) {
+        fprintf(stderr, "Usage: %s [-e bhash|cache=N|linear|segmented|expiring=MS|template] [-r repeats] trace.bin\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[optind], "rb");
+    if (!f) {
+        perror(argv[optind]);
+        return 1;
+    }
+    char magic[8];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, HASHMAP_TRACE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s: not a bhash trace\n", argv[optind]);
+        return 1;
+    }
+    size_t n = 0, capacity = 1024;
+    record_t *records = malloc(capacity*sizeof(record_t));
+    uint32_t word[2];
+    size_t counts[HASHMAP_TRACE_OP_MASK + 1] = {0};
+    while (records && fread(word, sizeof(word), 1, f) == 1) {
+        if (n == capacity) records = realloc(records, (capacity *= 2)*sizeof(record_t));
+        if (!records) break;
+        records[n++] = (record_t){word[0], word[1]};
+        ++counts[word[0] & HASHMAP_TRACE_OP_MASK];
+        if ((word[0] >> HASHMAP_TRACE_MAP_SHIFT) >= num_maps)
+            num_maps = (word[0] >> HASHMAP_TRACE_MAP_SHIFT) + 1;
+    }
+    (void)fclose(f);
+    maps = calloc(num_maps, sizeof(void*));
+    uint64_t *latency = malloc((n ? n : 1)*sizeof(uint64_t));
+    if (!records || !maps || !latency) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    printf("%s: %zu operations on %u maps (%zu get, %zu set, %zu next, %zu clear, %zu free)\n", argv[optind],
+           n, num_maps ? num_maps - 1 : 0, counts[HASHMAP_TRACE_GET], counts[HASHMAP_TRACE_SET],
+           counts[HASHMAP_TRACE_NEXT], counts[HASHMAP_TRACE_CLEAR], counts[HASHMAP_TRACE_FREE]);
+    if (n == 0) return 0;
+
+    size_t hits = 0;
+    double best = 0;
+    for (int rep = 0; rep < repeats; rep++) {
+        double start = now();
+        for (size_t i = 0; i < n; i++) {
+            if (i % 1000 == 0) ++fake_ms;
+            replay_one(engine, records[i], &hits);
+        }
+        free_maps(engine);
+        double secs = now() - start;
+        if (rep == 0 || secs < best) best = secs;
+    }
+    printf("%-12s %8.2f Mops/s %8.2f ns/op (best of %d)\n", engine_name, (double)n/best/1000000, best*1000000000/(double)n, repeats);
+
+    // The timer's own overhead is included in each latency, so these are most
+    // useful for comparing engines and finding outliers like resizes
+    long rss_before = resident_bytes();
+    hits = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (i % 1000 == 0) ++fake_ms;
+        uint64_t start = now_ns();
+        replay_one(engine, records[i], &hits);
+        latency[i] = now_ns() - start;
+    }
+    long rss_after = resident_bytes();
+    free_maps(engine);
+    qsort(latency, n, sizeof(uint64_t), compare_u64);
+    printf("latency (ns) p50 %" PRIu64 ", p99 %" PRIu64 ", p99.9 %" PRIu64 ", max %" PRIu64 "\n",
+           percentile(latency, n, 500), percentile(latency, n, 990), percentile(latency, n, 999), latency[n-1]);
+
+    struct rusage usage;
+    (void)getrusage(RUSAGE_SELF, &usage);
+    printf("memory: RSS grew by %ld KiB during the timed replay, %ld KiB peak RSS\n",
+           (rss_after - rss_before)/1024, usage.ru_maxrss);
+    printf("%zu lookups returned a value\n", hits);
+    free(latency);
+    free(maps);
+    free(records);
+    return 0;
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1
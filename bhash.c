@@ -12,10 +12,63 @@
 // which use a chained scatter with Brent's variation.
 // See README.md for more details.
 
+#define _GNU_SOURCE // For mremap()
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 
+// The library always defines the out-of-line hashmap_get()
+#define BHASH_NO_INLINE
 #include "bhash.h"
+#include "mph.h"
+
+// Number of slots the expiry sweeper examines per operation
+#define HASHMAP_SWEEP_STEPS 2
+// Deadlines are rebased before the clock offset can overflow a deadline
+#define HASHMAP_MAX_TTL 0x7FFFFFFFu
+// Segmented maps split a full subtable rather than growing it past this many
+// slots (unless its keys already share this many bits of the hash)
+#define HASHMAP_SEGMENT_SLOTS (1u << 16)
+#define HASHMAP_SEGMENT_MAX_DEPTH 24u
+
+// Saved maps are a header, the table's memory verbatim, and a checksum
+#define HASHMAP_FILE_MAGIC "bhashmap"
+#define HASHMAP_FILE_VERSION 3
+#define HASHMAP_BYTE_ORDER 0x01020304u
+// Tables are checksummed and written in chunks of this many bytes
+#define HASHMAP_IO_CHUNK (1u << 20)
+
+// Modes that delete entries outright instead of leaving NULL values behind
+#define HASHMAP_REMOVES (HASHMAP_BOUNDED|HASHMAP_EXPIRING|HASHMAP_SHARED|HASHMAP_LINEAR|HASHMAP_STATIC)
+
+typedef struct {
+    char magic[8];
+    uint32_t version, byte_order, word_size, entry_size;
+    uint32_t flags, ttl, now;
+    uint32_t seq; // Shared maps: odd while the writer is modifying the table
+    uint64_t capacity, count, lastfree, max_count, hand, sweep;
+    uint64_t writer; // Shared maps: the writer's process ID
+} hashmap_file_header_t;
+
+#ifdef BHASH_TRACE
+static void trace(hashmap_trace_op_t op, hashmap_t *h, const void *key, const void *value);
+#define TRACE(op, h, key, value) trace(op, h, key, value)
+// Every map with a table is marked, so callers' inline lookups reach trace()
+#define HASHMAP_TRACE_FLAGS HASHMAP_TRACED
+#else
+#define TRACE(op, h, key, value) ((void)0)
+#define HASHMAP_TRACE_FLAGS 0u
+#endif
 
 static void *(*custom_alloc)(size_t) = malloc;
 static void (*custom_free)(void*) = free;
@@ -26,121 +79,845 @@ void hashmap_set_allocator(void *(*alloc)(size_t), void (*free)(void*))
     custom_free = free;
 }
 
-static inline size_t hash_pointer(const void *p)
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000u + (uint64_t)ts.tv_nsec/1000000u;
+}
+
+static uint64_t (*custom_clock)(void) = monotonic_ms;
+
+void hashmap_set_clock(uint64_t (*now_ms)(void))
+{
+    custom_clock = now_ms ? now_ms : monotonic_ms;
+}
+
+#ifdef BHASH_TRACE
+// Maps and keys are numbered in the trace in order of first appearance (key 0
+// is NULL), using maps that are themselves not traced
+static FILE *trace_file;
+static bool tracing, trace_started;
+static hashmap_t *trace_maps, *trace_keys;
+static uint32_t num_trace_maps, num_trace_keys;
+
+static void trace_close(void)
+{
+    if (trace_file) (void)fclose(trace_file);
+    trace_file = NULL;
+}
+
+static uint32_t trace_id(hashmap_t *ids, uint32_t *count, const void *p)
+{
+    void *id = hashmap_get(ids, p);
+    if (!id) {
+        id = (void*)(uintptr_t)++*count;
+        (void)hashmap_set(ids, p, id);
+    }
+    return (uint32_t)(uintptr_t)id;
+}
+
+static void trace(hashmap_trace_op_t op, hashmap_t *h, const void *key, const void *value)
+{
+    if (tracing) return;
+    tracing = true;
+    if (!trace_started) {
+        trace_started = true;
+        const char *path = getenv("BHASH_TRACE_FILE");
+        trace_file = path ? fopen(path, "wb") : NULL;
+        if (trace_file) {
+            (void)fwrite(HASHMAP_TRACE_MAGIC, 1, 8, trace_file);
+            trace_maps = hashmap_new();
+            trace_keys = hashmap_new();
+            (void)atexit(trace_close);
+        }
+    }
+    // Maps that are freed before they're used aren't worth a record
+    if (trace_file && (op != HASHMAP_TRACE_FREE || hashmap_get(trace_maps, h))) {
+        uint32_t record[2] = {
+            (uint32_t)op | (value ? 0 : HASHMAP_TRACE_NULL)
+                | trace_id(trace_maps, &num_trace_maps, h) << HASHMAP_TRACE_MAP_SHIFT,
+            key ? trace_id(trace_keys, &num_trace_keys, key) : 0,
+        };
+        (void)fwrite(record, sizeof(record), 1, trace_file);
+        // The map's address may be reused for a new map
+        if (op == HASHMAP_TRACE_FREE) (void)hashmap_set(trace_maps, h, NULL);
+    }
+    tracing = false;
+}
+#endif
+
+// Chain links are stored as offsets between entries (0 for the end of a chain)
+// so that a table's layout doesn't depend on where it is in memory
+static inline hashmap_entry_t *next_entry(hashmap_entry_t *e)
+{
+    return e->next ? e + e->next : NULL;
+}
+
+static inline void link_entry(hashmap_entry_t *e, hashmap_entry_t *next)
+{
+    e->next = next ? next - e : 0;
+}
+
+// Bytes needed for a table's entries plus any per-slot metadata
+static size_t hashmap_alloc_size(hashmap_t *h, size_t capacity)
+{
+    size_t size = capacity*sizeof(hashmap_entry_t);
+    if (h->flags & HASHMAP_EXPIRING) size += capacity*sizeof(uint32_t);
+    if (h->flags & HASHMAP_BOUNDED) size += capacity;
+    return size;
+}
+
+// The per-slot metadata arrays in the space after the entries
+static inline uint32_t *hashmap_deadlines(hashmap_t *h)
+{
+    return (uint32_t*)(void*)&h->entries[h->capacity];
+}
+
+static inline unsigned char *hashmap_refs(hashmap_t *h)
+{
+    unsigned char *end = (unsigned char*)&h->entries[h->capacity];
+    return (h->flags & HASHMAP_EXPIRING) ? end + h->capacity*sizeof(uint32_t) : end;
+}
+
+// The index of the free-slot scan position, for saving it or moving the table.
+// Once every slot is in use, the scan position is below the first entry, and
+// that is stored as 0: slot 0 is in use then, so the scan moves on as usual.
+static inline uint64_t hashmap_lastfree_index(const hashmap_t *h)
+{
+    return h->lastfree > h->entries ? (uint64_t)(h->lastfree - h->entries) : 0;
+}
+
+// Copy a slot's metadata from one table into another
+static inline void hashmap_copy_meta(hashmap_t *dest, hashmap_entry_t *d, hashmap_t *src, hashmap_entry_t *s)
+{
+    if (dest->flags & HASHMAP_EXPIRING)
+        hashmap_deadlines(dest)[d - dest->entries] = hashmap_deadlines(src)[s - src->entries];
+    if (dest->flags & HASHMAP_BOUNDED)
+        hashmap_refs(dest)[d - dest->entries] = hashmap_refs(src)[s - src->entries];
+}
+
+static inline bool hashmap_expired(hashmap_t *h, hashmap_entry_t *e)
+{
+    return (h->flags & HASHMAP_EXPIRING) && hashmap_deadlines(h)[e - h->entries] <= h->extra->now;
+}
+
+// The index of a key's main slot. Static maps' main slots are the largest
+// power of two that fits, and the rest of the table holds chains.
+static inline size_t hashmap_index(hashmap_t *h, const void *key)
+{
+    size_t hash = bhash_hash_pointer(key);
+    if (__builtin_expect(!(h->flags & (HASHMAP_LINEAR|HASHMAP_STATIC)), 1)) return hash & (h->capacity-1);
+    if (h->flags & HASHMAP_STATIC)
+        return hash & (((size_t)1 << (63 - __builtin_clzll((uint64_t)h->capacity))) - 1);
+    size_t level = h->extra->level, i = hash & (level-1);
+    return i < h->extra->split ? hash & (2*level-1) : i;
+}
+
+static void *hashmap_put(hashmap_t *h, const void *key, const void *value, hashmap_entry_t **slot);
+static void *hashmap_lookup(hashmap_t *h, const void *key);
+static void hashmap_tick(hashmap_t *h);
+static void hashmap_remove_entry(hashmap_t *h, hashmap_entry_t *e);
+static hashmap_entry_t *hashmap_find(hashmap_t *h, const void *key);
+static void *hashmap_get_shared(hashmap_t *h, const void *key);
+static void hashmap_shared_begin(hashmap_t *h);
+static void hashmap_shared_end(hashmap_t *h);
+static void *hashmap_get_frozen(hashmap_t *h, const void *key);
+static const void *hashmap_next_frozen(hashmap_t *h, const void *key);
+static const void *hashmap_iterate(hashmap_t *h, const void *key);
+static void hashmap_release(hashmap_t *h);
+
+// Linear maps keep their table in an anonymous mapping with room to grow into.
+// When that runs out, mremap() moves the pages without copying them (chain
+// links are relative, so a table works anywhere in memory). Slots that haven't
+// been used yet take no physical memory.
+static bool hashmap_reserve(hashmap_t *h, size_t capacity)
 {
-    size_t s = (size_t)p;
-    if (s == 0) return 1234567;
-    return (s >> 5) | (s << (sizeof(void*) - 5));
+    if (capacity > SIZE_MAX/2/sizeof(hashmap_entry_t)) return false;
+    hashmap_extra_t *x = h->extra;
+    size_t needed = capacity*sizeof(hashmap_entry_t);
+    if (needed <= x->mapping_size) return true;
+    size_t size = x->mapping_size ? 2*x->mapping_size : 4096;
+    while (size < needed) size *= 2;
+    void *mapping;
+#ifdef __linux__
+    if (x->mapping) mapping = mremap(x->mapping, x->mapping_size, size, MREMAP_MAYMOVE);
+    else
+#endif
+    {
+        mapping = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (mapping != MAP_FAILED && x->mapping) {
+            memcpy(mapping, x->mapping, x->mapping_size);
+            (void)munmap(x->mapping, x->mapping_size);
+        }
+    }
+    if (mapping == MAP_FAILED) return false;
+    if (h->lastfree) h->lastfree = (hashmap_entry_t*)mapping + hashmap_lastfree_index(h);
+    h->entries = mapping;
+    x->mapping = mapping;
+    x->mapping_size = size;
+    return true;
 }
 
-static void hashmap_resize(hashmap_t *h, int new_size)
+// Grow a linear map by one slot. The next bucket in line is split with one
+// more bit of the hash: the entries in its chain that now belong in the new
+// slot at the end of the table are relinked into a chain starting there.
+static bool hashmap_split(hashmap_t *h)
 {
+    if (!hashmap_reserve(h, h->capacity + 1)) return false;
+    hashmap_extra_t *x = h->extra;
+    size_t bucket = x->split;
+    hashmap_entry_t *home[2] = {&h->entries[bucket], &h->entries[h->capacity]};
+    bool chained = home[0]->key && hashmap_index(h, home[0]->key) == bucket;
+    ++h->capacity;
+    if (++x->split == x->level) {
+        x->level *= 2;
+        x->split = 0;
+    }
+    // Free slots are easiest to find among the newest slots, since the buckets
+    // that haven't been split yet are the most crowded
+    h->lastfree = &h->entries[h->capacity - 1];
+    if (!chained) return true;
+
+    hashmap_entry_t *tail[2] = {NULL, NULL};
+    for (hashmap_entry_t *e = home[0], *next; e; e = next) {
+        next = next_entry(e);
+        int half = hashmap_index(h, e->key) != bucket;
+        if (!tail[half] && e != home[half]) { // A chain's first entry goes in its main slot
+            memcpy(home[half], e, sizeof(hashmap_entry_t));
+            memset(e, 0, sizeof(hashmap_entry_t));
+            e = home[half];
+        }
+        if (tail[half]) link_entry(tail[half], e);
+        tail[half] = e;
+    }
+    for (int half = 0; half < 2; half++)
+        if (tail[half]) tail[half]->next = 0;
+    return true;
+}
+
+static void hashmap_resize(hashmap_t *h, size_t new_size)
+{
+    if (h->flags & HASHMAP_LINEAR) { // Linear maps only start their first table here
+        if (!hashmap_reserve(h, new_size)) return;
+        h->capacity = h->extra->level = new_size;
+        h->extra->split = 0;
+        h->lastfree = &h->entries[new_size - 1];
+        return;
+    }
     hashmap_t old = *h;
-    size_t size = (size_t)new_size*sizeof(hashmap_entry_t);
+    size_t size = hashmap_alloc_size(h, new_size);
     h->entries = custom_alloc(size);
     h->fallback = old.fallback;
+    h->flags |= HASHMAP_TRACE_FLAGS;
     memset(h->entries, 0, size);
     h->capacity = new_size;
     h->count = 0;
     h->lastfree = &h->entries[new_size - 1];
     if (old.entries) {
         // Rehash:
-        for (int i = 0; i < old.capacity; i++)
-            if (old.entries[i].key)
-                (void)hashmap_set(h, old.entries[i].key, old.entries[i].value);
+        for (size_t i = 0; i < old.capacity; i++) {
+            hashmap_entry_t *e = &old.entries[i], *slot;
+            if (!e->key || hashmap_expired(&old, e)) continue;
+            (void)hashmap_put(h, e->key, e->value, &slot);
+            if (slot) hashmap_copy_meta(h, slot, &old, e);
+        }
         if (custom_free) custom_free(old.entries);
     }
 }
 
+void hashmap_init(hashmap_t *h)
+{
+    memset(h, 0, sizeof(hashmap_t));
+}
+
 hashmap_t *hashmap_new(void)
 {
     hashmap_t *h = custom_alloc(sizeof(hashmap_t));
     if (!h) return h;
+    hashmap_init(h);
+    return h;
+}
+
+// Give a map zeroed mode state, if it doesn't have any yet
+static bool hashmap_add_extra(hashmap_t *h)
+{
+    if (!h->extra) {
+        h->extra = custom_alloc(sizeof(hashmap_extra_t));
+        if (!h->extra) return false;
+        memset(h->extra, 0, sizeof(hashmap_extra_t));
+    }
+    return true;
+}
+
+// Allocate a map that will be given a special mode
+static hashmap_t *hashmap_new_extra(void)
+{
+    hashmap_t *h = hashmap_new();
+    if (h && !hashmap_add_extra(h)) {
+        if (custom_free) custom_free(h);
+        return NULL;
+    }
+    return h;
+}
+
+hashmap_t *hashmap_new_cache(size_t max_count)
+{
+    if (max_count == 0 || max_count > SIZE_MAX/2/sizeof(hashmap_entry_t)) return NULL;
+    hashmap_t *h = hashmap_new_extra();
+    if (!h) return h;
+    size_t capacity = 16;
+    while (capacity < max_count) capacity *= 2;
+    h->flags = HASHMAP_BOUNDED;
+    h->extra->max_count = max_count;
+    hashmap_resize(h, capacity);
+    return h;
+}
+
+hashmap_t *hashmap_new_expiring(uint32_t ttl_ms)
+{
+    hashmap_t *h = hashmap_new_extra();
+    if (!h) return h;
+    h->flags = HASHMAP_EXPIRING;
+    h->extra->ttl = ttl_ms < HASHMAP_MAX_TTL ? ttl_ms : HASHMAP_MAX_TTL;
+    h->extra->epoch = custom_clock();
+    return h;
+}
+
+hashmap_t *hashmap_new_linear(void)
+{
+    hashmap_t *h = hashmap_new_extra();
+    if (!h) return h;
+    h->flags = HASHMAP_LINEAR;
+    return h;
+}
+
+char hashmap_full;
+
+bool hashmap_init_static(hashmap_t *h, hashmap_entry_t *buffer, size_t capacity)
+{
+    if (capacity < 2) return false;
     memset(h, 0, sizeof(hashmap_t));
+    memset(buffer, 0, capacity*sizeof(hashmap_entry_t));
+    h->flags = HASHMAP_STATIC;
+    h->entries = buffer;
+    h->capacity = capacity;
+    h->lastfree = &buffer[capacity - 1];
+    return true;
+}
+
+hashmap_t *hashmap_new_segmented(void)
+{
+    hashmap_t *h = hashmap_new_extra();
+    if (!h) return h;
+    h->flags = HASHMAP_SEGMENTED;
+    h->extra->segments = custom_alloc(sizeof(hashmap_t*));
+    if (h->extra->segments) h->extra->segments[0] = hashmap_new_extra();
+    if (!h->extra->segments || !h->extra->segments[0]) hashmap_free(&h);
     return h;
 }
 
+// Segmented maps pick a subtable with the top bits of a remixed hash, which
+// are unrelated to the low bits that pick a slot within the subtable
+static inline uint64_t hashmap_segment_hash(const void *key)
+{
+    return (uint64_t)bhash_hash_pointer(key) * 0x9E3779B97F4A7C15u;
+}
+
+static inline size_t hashmap_segment_index(hashmap_t *h, const void *key)
+{
+    unsigned int depth = h->extra->depth;
+    return depth ? (size_t)(hashmap_segment_hash(key) >> (64 - depth)) : 0;
+}
+
+// The number of directory entries pointing to a subtable (which are adjacent,
+// so stepping by this visits each subtable once)
+static inline size_t hashmap_segment_span(hashmap_t *h, hashmap_t *sub)
+{
+    return (size_t)1 << (h->extra->depth - sub->extra->depth);
+}
+
+// Split the subtable at directory entry `j` in two using one more bit of the
+// hash, doubling the directory first if it doesn't have a bit to spare
+static bool hashmap_split_segment(hashmap_t *h, size_t j)
+{
+    hashmap_extra_t *x = h->extra;
+    hashmap_t *old = x->segments[j];
+    unsigned int depth = old->extra->depth;
+    if (depth == x->depth) {
+        size_t n = (size_t)1 << x->depth;
+        hashmap_t **segments = custom_alloc(2*n*sizeof(hashmap_t*));
+        if (!segments) return false;
+        for (size_t i = 0; i < 2*n; i++)
+            segments[i] = x->segments[i/2];
+        if (custom_free) custom_free(x->segments);
+        x->segments = segments;
+        ++x->depth;
+        j *= 2;
+    }
+    hashmap_t *halves[2] = {hashmap_new_extra(), hashmap_new_extra()};
+    if (!halves[0] || !halves[1]) {
+        for (int half = 0; half < 2; half++) {
+            if (!halves[half] || !custom_free) continue;
+            hashmap_release(halves[half]);
+            custom_free(halves[half]);
+        }
+        return false;
+    }
+    halves[0]->extra->depth = halves[1]->extra->depth = depth + 1;
+    for (size_t i = 0; i < old->capacity; i++) {
+        hashmap_entry_t *e = &old->entries[i];
+        if (!e->key || !e->value) continue;
+        hashmap_t *sub = halves[(hashmap_segment_hash(e->key) >> (63 - depth)) & 1];
+        if (sub->capacity == 0) hashmap_resize(sub, 16);
+        (void)hashmap_put(sub, e->key, e->value, NULL);
+    }
+    size_t span = hashmap_segment_span(h, old), start = j & ~(span - 1);
+    for (size_t i = 0; i < span; i++)
+        x->segments[start + i] = halves[i >= span/2];
+    h->capacity = h->capacity - old->capacity + halves[0]->capacity + halves[1]->capacity;
+    if (custom_free) {
+        hashmap_release(old);
+        custom_free(old);
+    }
+    return true;
+}
+
+static void *hashmap_set_segmented(hashmap_t *h, const void *key, const void *value)
+{
+    size_t j = hashmap_segment_index(h, key);
+    hashmap_t *sub = h->extra->segments[j];
+    while (value && sub->count >= sub->capacity && sub->capacity >= HASHMAP_SEGMENT_SLOTS
+           && sub->extra->depth < HASHMAP_SEGMENT_MAX_DEPTH && hashmap_split_segment(h, j)) {
+        j = hashmap_segment_index(h, key);
+        sub = h->extra->segments[j];
+    }
+    size_t count = sub->count, capacity = sub->capacity;
+    if (sub->capacity == 0) hashmap_resize(sub, 16);
+    void *old_value = hashmap_put(sub, key, value, NULL);
+    h->count = h->count - count + sub->count;
+    h->capacity = h->capacity - capacity + sub->capacity;
+    return old_value;
+}
+
+static const void *hashmap_next_segmented(hashmap_t *h, const void *key)
+{
+    hashmap_t **segments = h->extra->segments;
+    size_t n = (size_t)1 << h->extra->depth, j = 0;
+    if (key) {
+        j = hashmap_segment_index(h, key);
+        hashmap_t *sub = segments[j];
+        // Like plain maps, a key that isn't in the map ends the iteration
+        if (sub->capacity == 0 || !hashmap_find(sub, key)) return NULL;
+        const void *next = hashmap_iterate(sub, key);
+        if (next) return next;
+        j = (j & ~(hashmap_segment_span(h, sub) - 1)) + hashmap_segment_span(h, sub);
+    }
+    for (; j < n; j += hashmap_segment_span(h, segments[j])) {
+        const void *first = hashmap_iterate(segments[j], NULL);
+        if (first) return first;
+    }
+    return NULL;
+}
+
 hashmap_t *hashmap_copy(hashmap_t *h)
 {
-    hashmap_t *copy = hashmap_new();
+    if (h->flags & HASHMAP_SEGMENTED) {
+        hashmap_t *copy = hashmap_new_segmented();
+        if (!copy) return copy;
+        for (const void *key = hashmap_iterate(h, NULL); key; key = hashmap_iterate(h, key))
+            (void)hashmap_set_segmented(copy, key, hashmap_lookup(h, key));
+        copy->fallback = h->fallback;
+        return copy;
+    }
+    hashmap_t *copy = (h->flags & HASHMAP_BOUNDED) ? hashmap_new_cache(h->extra->max_count) : hashmap_new();
     if (!copy) return copy;
+    copy->flags = h->flags & ~(unsigned)(HASHMAP_READONLY|HASHMAP_SHARED|HASHMAP_FROZEN|HASHMAP_STATIC);
+    if ((copy->flags & (HASHMAP_EXPIRING|HASHMAP_LINEAR)) && !hashmap_add_extra(copy)) {
+        hashmap_free(&copy);
+        return NULL;
+    }
+    if (copy->flags & HASHMAP_EXPIRING) {
+        copy->extra->ttl = h->extra->ttl;
+        copy->extra->epoch = h->extra->epoch;
+        copy->extra->now = h->extra->now;
+    }
+
+    for (size_t i = 0; i < h->count && (h->flags & HASHMAP_FROZEN); i++)
+        (void)hashmap_set(copy, h->extra->pairs[i].key, h->extra->pairs[i].value);
 
-    int capacity = h->capacity;
+    size_t capacity = h->capacity;
     hashmap_entry_t *entries = h->entries;
-    for (int i = 0; i < capacity; i++)
-        if (entries[i].key)
-            (void)hashmap_set(copy, entries[i].key, entries[i].value);
+    for (size_t i = 0; i < capacity; i++) {
+        hashmap_entry_t *slot;
+        if (!entries[i].key || !entries[i].value || hashmap_expired(h, &entries[i])) continue;
+        if (copy->capacity == 0) hashmap_resize(copy, 16);
+        (void)hashmap_put(copy, entries[i].key, entries[i].value, &slot);
+        if (slot) hashmap_copy_meta(copy, slot, h, &entries[i]);
+    }
     copy->fallback = h->fallback;
     return copy;
 }
 
 size_t hashmap_length(hashmap_t *h)
 {
-    return (size_t)h->count;
+    if ((h->flags & (HASHMAP_SHARED|HASHMAP_READONLY)) == (HASHMAP_SHARED|HASHMAP_READONLY))
+        return (size_t)__atomic_load_n(&((hashmap_file_header_t*)h->extra->mapping)->count, __ATOMIC_RELAXED);
+    return h->count;
 }
 
 void hashmap_clear(hashmap_t *h)
 {
-    if (h->capacity == 0) return;
-    if (custom_free) custom_free(h->entries);
+    TRACE(HASHMAP_TRACE_CLEAR, h, NULL, NULL);
+    if (h->capacity == 0 || (h->flags & HASHMAP_READONLY)) return;
+    if (h->flags & HASHMAP_SEGMENTED) { // Keep the directory, but empty every subtable
+        hashmap_t **segments = h->extra->segments;
+        for (size_t j = 0; j < (size_t)1 << h->extra->depth; j += hashmap_segment_span(h, segments[j])) {
+            hashmap_t *sub = segments[j];
+            if (custom_free) custom_free(sub->entries);
+            sub->entries = sub->lastfree = NULL;
+            sub->capacity = sub->count = 0;
+        }
+        h->capacity = h->count = 0;
+        return;
+    }
+    if (h->flags & (HASHMAP_BOUNDED|HASHMAP_SHARED|HASHMAP_STATIC)) { // Keep the preallocated table
+        if (h->flags & HASHMAP_SHARED) hashmap_shared_begin(h);
+        memset(h->entries, 0, hashmap_alloc_size(h, h->capacity));
+        h->lastfree = &h->entries[h->capacity - 1];
+        h->count = 0;
+        if (h->extra) h->extra->hand = h->extra->sweep = 0;
+        if (h->flags & HASHMAP_SHARED) hashmap_shared_end(h);
+        return;
+    }
+    hashmap_extra_t *x = h->extra;
+    if (x && x->mapping) (void)munmap(x->mapping, x->mapping_size);
+    else if (custom_free) custom_free(h->entries);
     h->entries = NULL;
     h->lastfree = NULL;
     h->capacity = 0;
     h->count = 0;
+    if (x) {
+        x->mapping = NULL;
+        x->mapping_size = 0;
+        x->sweep = 0;
+        x->level = x->split = 0;
+    }
 }
 
-void *hashmap_get(hashmap_t *h, const void *key)
+static void *hashmap_lookup(hashmap_t *h, const void *key)
 {
+    if ((h->flags & (HASHMAP_SHARED|HASHMAP_READONLY)) == (HASHMAP_SHARED|HASHMAP_READONLY))
+        return hashmap_get_shared(h, key);
+    if (h->flags & HASHMAP_FROZEN)
+        return hashmap_get_frozen(h, key);
+    if (h->flags & HASHMAP_SEGMENTED) {
+        void *value = hashmap_lookup(h->extra->segments[hashmap_segment_index(h, key)], key);
+        return value || !h->fallback ? value : hashmap_lookup(h->fallback, key);
+    }
     if (h->capacity > 0) {
-        int i = (int)(hash_pointer(key) & (size_t)(h->capacity-1));
-        for (hashmap_entry_t *e = &h->entries[i]; e && e->key; e = e->next) {
-            if (e->key == key)
+        if (h->flags & HASHMAP_EXPIRING) hashmap_tick(h);
+        size_t i = hashmap_index(h, key);
+        for (hashmap_entry_t *e = &h->entries[i]; e && e->key; e = next_entry(e)) {
+            if (e->key == key) {
+                if (hashmap_expired(h, e)) { // Lazily reclaim expired entries
+                    if (!(h->flags & HASHMAP_READONLY)) hashmap_remove_entry(h, e);
+                    break;
+                }
+                if ((h->flags & (HASHMAP_BOUNDED|HASHMAP_READONLY)) == HASHMAP_BOUNDED)
+                    hashmap_refs(h)[e - h->entries] = 1;
                 return e->value;
+            }
         }
     }
-    if (h->fallback) return hashmap_get(h->fallback, key);
+    if (h->fallback) return hashmap_lookup(h->fallback, key);
     return NULL;
 }
 
+void *hashmap_get(hashmap_t *h, const void *key)
+{
+    void *value = hashmap_lookup(h, key);
+    TRACE(HASHMAP_TRACE_GET, h, key, value);
+    return value;
+}
+
+static hashmap_entry_t *hashmap_find(hashmap_t *h, const void *key)
+{
+    size_t i = hashmap_index(h, key);
+    for (hashmap_entry_t *e = &h->entries[i]; e && e->key; e = next_entry(e)) {
+        if (e->key == key)
+            return e;
+    }
+    return NULL;
+}
+
+// Move an entry (and its slot metadata) from one slot to another
+static inline void hashmap_move_entry(hashmap_t *h, hashmap_entry_t *dest, hashmap_entry_t *src)
+{
+    memcpy(dest, src, sizeof(hashmap_entry_t));
+    link_entry(dest, next_entry(src));
+    hashmap_copy_meta(h, dest, h, src);
+}
+
+// Unlink an entry from its chain and free up its slot for reuse
+static void hashmap_remove_entry(hashmap_t *h, hashmap_entry_t *e)
+{
+    hashmap_entry_t *main = &h->entries[hashmap_index(h, e->key)];
+    hashmap_entry_t *freed = e;
+    if (e == main) { // Chain head: pull the second node up into this slot
+        if (e->next) {
+            freed = next_entry(e);
+            hashmap_move_entry(h, e, freed);
+        }
+    } else {
+        hashmap_entry_t *prev = main;
+        while (next_entry(prev) != e)
+            prev = next_entry(prev);
+        link_entry(prev, next_entry(e));
+    }
+    memset(freed, 0, sizeof(hashmap_entry_t));
+    if (h->flags & HASHMAP_EXPIRING) hashmap_deadlines(h)[freed - h->entries] = 0;
+    if (h->flags & HASHMAP_BOUNDED) hashmap_refs(h)[freed - h->entries] = 0;
+    // Hand the freed slot to the next insertion that needs one
+    h->lastfree = freed;
+    --h->count;
+}
+
+// Advance the CLOCK hand until it finds an unreferenced entry, then evict it
+static void hashmap_evict(hashmap_t *h)
+{
+    unsigned char *refs = hashmap_refs(h);
+    for (;;) {
+        hashmap_entry_t *e = &h->entries[h->extra->hand];
+        h->extra->hand = (h->extra->hand + 1) & (h->capacity - 1);
+        if (!e->key) continue;
+        if (refs[e - h->entries]) {
+            refs[e - h->entries] = 0;
+            continue;
+        }
+        hashmap_remove_entry(h, e);
+        return;
+    }
+}
+
+// Shared maps use a seqlock: the writer makes the sequence number odd while it
+// modifies the table, and readers retry any lookup that overlapped a change.
+static inline hashmap_file_header_t *hashmap_shared_header(hashmap_t *h)
+{
+    return (hashmap_file_header_t*)h->extra->mapping;
+}
+
+static void hashmap_shared_begin(hashmap_t *h)
+{
+    hashmap_file_header_t *header = hashmap_shared_header(h);
+    __atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void hashmap_shared_end(hashmap_t *h)
+{
+    hashmap_file_header_t *header = hashmap_shared_header(h);
+    header->count = h->count;
+    header->lastfree = hashmap_lastfree_index(h);
+    __atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Whether the writer process still exists (it may be a different user's)
+static bool hashmap_writer_alive(const hashmap_file_header_t *header)
+{
+    pid_t pid = (pid_t)__atomic_load_n(&header->writer, __ATOMIC_RELAXED);
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+static void *hashmap_get_shared(hashmap_t *h, const void *key)
+{
+    hashmap_file_header_t *header = hashmap_shared_header(h);
+    for (unsigned int spins = 0; ; spins++) {
+        uint32_t seq = __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) { // Writer is busy (give it the CPU if it's been a while)
+            if (spins % 64 == 63) sched_yield();
+            // A writer that died in the middle of a change will never finish it
+            if (spins % 4096 == 4095 && !hashmap_writer_alive(header)) return NULL;
+            continue;
+        }
+        void *value = NULL;
+        // The table may change underneath us, so every link is bounds-checked
+        // and the walk is capped at the table size before the recheck
+        size_t i = bhash_hash_pointer(key) & (h->capacity-1);
+        for (size_t steps = 0; steps < h->capacity; steps++) {
+            hashmap_entry_t *e = &h->entries[i];
+            const void *k = __atomic_load_n(&e->key, __ATOMIC_RELAXED);
+            if (!k) break;
+            if (k == key) {
+                value = __atomic_load_n(&e->value, __ATOMIC_RELAXED);
+                break;
+            }
+            ptrdiff_t next = __atomic_load_n(&e->next, __ATOMIC_RELAXED);
+            if (next == 0 || (next < 0 && (size_t)-next > i) || (next > 0 && (size_t)next >= h->capacity - i))
+                break;
+            i = (size_t)((ptrdiff_t)i + next);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&header->seq, __ATOMIC_RELAXED) == seq)
+            return value;
+    }
+}
+
+// Update the expiring map's clock and reclaim a few expired entries
+static void hashmap_tick(hashmap_t *h)
+{
+    hashmap_extra_t *x = h->extra;
+    uint64_t now = custom_clock() - x->epoch;
+    if (h->flags & HASHMAP_READONLY) {
+        // Views can't rebase their deadlines, but every deadline fits in 32
+        // bits, so once the clock passes that range everything has expired
+        x->now = now > UINT32_MAX ? UINT32_MAX : (uint32_t)now;
+        return;
+    }
+    if (now > HASHMAP_MAX_TTL) {
+        // Shift the epoch forward so that now + ttl always fits in 32 bits.
+        // The shift is 64 bits wide: if the clock jumped past every 32-bit
+        // deadline, every deadline becomes 0 and everything has expired.
+        uint64_t shift = now - (now & HASHMAP_MAX_TTL);
+        uint32_t *deadlines = hashmap_deadlines(h);
+        x->epoch += shift;
+        now -= shift;
+        for (size_t i = 0; i < h->capacity; i++)
+            deadlines[i] = deadlines[i] > shift ? (uint32_t)(deadlines[i] - shift) : 0;
+    }
+    x->now = (uint32_t)now;
+
+    for (int n = 0; n < HASHMAP_SWEEP_STEPS && h->count > 0; n++) {
+        hashmap_entry_t *e = &h->entries[x->sweep];
+        if (e->key && hashmap_expired(h, e)) {
+            // Removal may pull another entry into this slot, so look again
+            hashmap_remove_entry(h, e);
+            continue;
+        }
+        x->sweep = (x->sweep + 1) & (h->capacity - 1);
+    }
+}
+
+// Caches and expiring maps delete entries for real (instead of leaving a NULL
+// value) so their slots can be reused without rehashing the table.
+static void *hashmap_set_removable(hashmap_t *h, const void *key, const void *value, uint32_t ttl_ms)
+{
+    if (h->flags & HASHMAP_EXPIRING) hashmap_tick(h);
+
+    hashmap_entry_t *e = hashmap_find(h, key);
+    if (e && hashmap_expired(h, e)) {
+        hashmap_remove_entry(h, e);
+        e = NULL;
+    }
+
+    void *old_value = NULL;
+    if (e) {
+        old_value = e->value;
+        if (!value) {
+            hashmap_remove_entry(h, e);
+            return old_value;
+        }
+        e->value = (void*)value;
+        if (h->flags & HASHMAP_BOUNDED) hashmap_refs(h)[e - h->entries] = 1;
+    } else {
+        if (!value) return NULL;
+        if ((h->flags & HASHMAP_BOUNDED) && h->count >= h->extra->max_count)
+            hashmap_evict(h);
+        (void)hashmap_put(h, key, value, &e);
+        // The table is full and can't grow (or a linear map ran out of memory)
+        if (!e) return (h->flags & (HASHMAP_SHARED|HASHMAP_STATIC|HASHMAP_LINEAR)) ? HASHMAP_FULL : NULL;
+    }
+    if (h->flags & HASHMAP_EXPIRING) {
+        if (ttl_ms > HASHMAP_MAX_TTL) ttl_ms = HASHMAP_MAX_TTL;
+        hashmap_deadlines(h)[e - h->entries] = h->extra->now + ttl_ms;
+    }
+    return old_value;
+}
+
 void *hashmap_set(hashmap_t *h, const void *key, const void *value)
 {
-    if (key == NULL) return NULL;
+    TRACE(HASHMAP_TRACE_SET, h, key, value);
+    if (key == NULL || (h->flags & HASHMAP_READONLY)) return NULL;
+    if (h->flags & HASHMAP_SEGMENTED) return hashmap_set_segmented(h, key, value);
+
+    if (h->capacity == 0) hashmap_resize(h, 16);
+    if (h->capacity == 0) return value ? HASHMAP_FULL : NULL; // A linear map couldn't map its table
 
+    if (h->flags & HASHMAP_SHARED) {
+        hashmap_shared_begin(h);
+        void *old_value = hashmap_set_removable(h, key, value, 0);
+        hashmap_shared_end(h);
+        return old_value;
+    }
+    if (h->flags & HASHMAP_REMOVES)
+        return hashmap_set_removable(h, key, value, (h->flags & HASHMAP_EXPIRING) ? h->extra->ttl : 0);
+    return hashmap_put(h, key, value, NULL);
+}
+
+void *hashmap_set_ttl(hashmap_t *h, const void *key, const void *value, uint32_t ttl_ms)
+{
+    if (!(h->flags & HASHMAP_EXPIRING)) return hashmap_set(h, key, value);
+    TRACE(HASHMAP_TRACE_SET, h, key, value);
+    if (key == NULL || (h->flags & HASHMAP_READONLY)) return NULL;
     if (h->capacity == 0) hashmap_resize(h, 16);
+    return hashmap_set_removable(h, key, value, ttl_ms);
+}
 
+// Insert or update a key in the table (which must have nonzero capacity). If
+// `slot` is given, it is set to the newly inserted entry (NULL for updates).
+static void *hashmap_put(hashmap_t *h, const void *key, const void *value, hashmap_entry_t **slot)
+{
+    if (slot) *slot = NULL;
   retry:;
-    int i = (int)(hash_pointer(key) & (size_t)(h->capacity-1));
+    if ((h->flags & HASHMAP_LINEAR) && value && 4*(h->count + 1) > 3*h->capacity && hashmap_split(h))
+        goto retry;
+    size_t i = hashmap_index(h, key);
     hashmap_entry_t *collision = &h->entries[i];
     if (!collision->key) { // Found empty slot
         if (!value) return NULL;
         collision->key = key;
         collision->value = (void*)value;
-        collision->next = NULL;
+        collision->next = 0;
         ++h->count;
+        if (slot) *slot = collision;
         return NULL;
     }
 
-    int i2 = (int)(hash_pointer(collision->key) & (size_t)(h->capacity-1));
+    size_t i2 = hashmap_index(h, collision->key);
     if (i2 == i) { // Hit a node in the correct place
         // Check for update to existing key:
-        for (hashmap_entry_t *e = collision; e && e->key; e = e->next) {
+        for (hashmap_entry_t *e = collision; e && e->key; e = next_entry(e)) {
             if (e->key == key) { // Update value
                 void *old_value = e->value;
-                h->count += (value ? 1 : 0) + (old_value ? -1 : 0);
+                if (value && !old_value) ++h->count;
+                else if (!value && old_value) --h->count;
                 e->value = (void*)value;
                 return old_value;
             }
         }
     }
+    if (!value) return NULL; // Nothing to remove
 
     // Find a free space to insert:
     while (h->lastfree >= h->entries && h->lastfree->key)
         --h->lastfree;
 
+    // Maps that remove entries wrap around to reuse freed slots rather than
+    // rehashing while the table still has room (caches, shared maps and static
+    // maps never grow, and linear maps grow only by splitting)
+    bool fixed = (h->flags & (HASHMAP_BOUNDED|HASHMAP_SHARED|HASHMAP_LINEAR|HASHMAP_STATIC)) != 0;
+    if (h->lastfree < h->entries && (h->flags & HASHMAP_REMOVES)
+        && h->count < (fixed ? h->capacity : h->capacity - h->capacity/4)) {
+        h->lastfree = &h->entries[h->capacity - 1];
+        while (h->lastfree->key)
+            --h->lastfree;
+    }
+
     // No spaces left, gotta resize and try again:
     if (h->lastfree < h->entries) {
-        int newsize = h->capacity;
-        if (h->count + 1 > newsize) newsize *= 2;
+        if (fixed) return NULL;
+        size_t newsize = h->capacity;
+        if (h->count + 1 > newsize || (h->flags & HASHMAP_EXPIRING)) newsize *= 2;
         else if (h->count + 1 <= newsize/2) newsize /= 2;
         hashmap_resize(h, newsize);
         goto retry;
@@ -151,22 +928,25 @@ void *hashmap_set(hashmap_t *h, const void *key, const void *value)
         h->lastfree->key = key;
         h->lastfree->value = (void*)value;
         // Put it between the colliding node and the second node in the chain
-        h->lastfree->next = collision->next;
-        collision->next = h->lastfree;
+        link_entry(h->lastfree, next_entry(collision));
+        link_entry(collision, h->lastfree);
+        if (slot) *slot = h->lastfree;
     } else { // Hit the middle of a chain for some other hash value
         // Rearrange from prevcollision..collision@i..nextcollision, NULL@nextfree
         // to: (key:value)@i, prevcollision..collision@nextfree..nextcollision
         hashmap_entry_t *prev = &h->entries[i2];
-        while (prev->next != collision)
-            prev = prev->next;
+        while (next_entry(prev) != collision)
+            prev = next_entry(prev);
 
         // Scootch collider to new space
-        memcpy(h->lastfree, collision, sizeof(hashmap_entry_t));
-        prev->next = h->lastfree;
+        hashmap_move_entry(h, h->lastfree, collision);
+        link_entry(prev, h->lastfree);
 
         collision->key = key;
         collision->value = (void*)value;
-        collision->next = NULL;
+        collision->next = 0;
+        if (h->flags & HASHMAP_BOUNDED) hashmap_refs(h)[collision - h->entries] = 0;
+        if (slot) *slot = collision;
     }
     ++h->count;
     return NULL;
@@ -174,30 +954,340 @@ void *hashmap_set(hashmap_t *h, const void *key, const void *value)
 
 const void *hashmap_next(hashmap_t *h, const void *key)
 {
+    TRACE(HASHMAP_TRACE_NEXT, h, key, key);
+    return hashmap_iterate(h, key);
+}
+
+static const void *hashmap_iterate(hashmap_t *h, const void *key)
+{
+    if (h->flags & HASHMAP_FROZEN) return hashmap_next_frozen(h, key);
+    if (h->flags & HASHMAP_SEGMENTED) return hashmap_next_segmented(h, key);
     if (h->capacity == 0) return NULL;
     hashmap_entry_t *e = &h->entries[0];
     if (key) {
         // Find entry in the hash table
-        int i = (int)(hash_pointer(key) & (size_t)(h->capacity-1));
+        size_t i = hashmap_index(h, key);
         e = &h->entries[i];
         if (!e->key) return NULL;
         while (e && e->key != key)
-            e = e->next;
+            e = next_entry(e);
         if (!e) return NULL;
         // Then start looking for the next free entry after it
         ++e;
     }
     for (; e < &h->entries[h->capacity]; e++)
-        if (e->key && e->value) return e->key;
+        if (e->key && e->value && !hashmap_expired(h, e)) return e->key;
 
     return NULL;
 }
 
+// Free a map's tables (and a segmented map's subtables), but not the map itself
+static void hashmap_release(hashmap_t *h)
+{
+    hashmap_extra_t *x = h->extra;
+    if (x && x->mapping) (void)munmap(x->mapping, x->mapping_size);
+    else if (h->entries && !(h->flags & HASHMAP_STATIC)) custom_free(h->entries);
+    if (!x) return;
+    if (x->pairs) custom_free(x->pairs);
+    if (x->segments) {
+        for (size_t j = 0; j < (size_t)1 << x->depth && x->segments[j]; ) {
+            hashmap_t *sub = x->segments[j];
+            j += hashmap_segment_span(h, sub);
+            hashmap_release(sub);
+            custom_free(sub);
+        }
+        custom_free(x->segments);
+    }
+    custom_free(x);
+}
+
 void hashmap_free(hashmap_t **h)
 {
     if (*h == NULL || !custom_free) return;
-    if ((*h)->entries) custom_free((*h)->entries);
+    TRACE(HASHMAP_TRACE_FREE, *h, NULL, NULL);
+    hashmap_release(*h);
     custom_free(*h);
     *h = NULL;
 }
+
+void hashmap_destroy(hashmap_t *h)
+{
+    TRACE(HASHMAP_TRACE_FREE, h, NULL, NULL);
+    if (custom_free) hashmap_release(h);
+    hashmap_init(h);
+}
+
+static uint64_t checksum(uint64_t sum, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), p += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        sum = (sum + word) * 0x9E3779B97F4A7C15u;
+        sum ^= sum >> 32;
+    }
+    for (; len > 0; len--, p++)
+        sum = (sum + *p) * 0x9E3779B97F4A7C15u;
+    return sum;
+}
+
+bool hashmap_save(hashmap_t *h, FILE *f)
+{
+    if (h->flags & (HASHMAP_FROZEN|HASHMAP_LINEAR|HASHMAP_SEGMENTED|HASHMAP_STATIC)) return false;
+    // A shared map's writer can change the table while a reader copies it
+    if ((h->flags & (HASHMAP_SHARED|HASHMAP_READONLY)) == (HASHMAP_SHARED|HASHMAP_READONLY)) return false;
+    const hashmap_extra_t none = {0}, *x = h->extra ? h->extra : &none;
+    // Views and shared maps are saved as ordinary maps
+    hashmap_file_header_t header = {
+        .magic = HASHMAP_FILE_MAGIC, .version = HASHMAP_FILE_VERSION, .byte_order = HASHMAP_BYTE_ORDER,
+        .word_size = sizeof(void*), .entry_size = sizeof(hashmap_entry_t),
+        .flags = h->flags & ~(unsigned)(HASHMAP_TRACED|HASHMAP_READONLY|HASHMAP_SHARED),
+        .ttl = x->ttl, .now = x->now, .hand = x->hand, .sweep = x->sweep,
+        .capacity = h->capacity, .count = h->count, .max_count = x->max_count,
+        .lastfree = h->capacity > 0 ? hashmap_lastfree_index(h) : 0,
+    };
+    uint64_t sum = checksum(0, &header, sizeof(header));
+    if (fwrite(&header, sizeof(header), 1, f) != 1) return false;
+
+    // Stream the table straight from memory, a chunk at a time
+    const char *table = (const char*)h->entries;
+    size_t size = h->capacity > 0 ? hashmap_alloc_size(h, h->capacity) : 0;
+    for (size_t pos = 0; pos < size; pos += HASHMAP_IO_CHUNK) {
+        size_t len = size - pos < HASHMAP_IO_CHUNK ? size - pos : HASHMAP_IO_CHUNK;
+        sum = checksum(sum, table + pos, len);
+        if (fwrite(table + pos, 1, len, f) != len) return false;
+    }
+    return fwrite(&sum, sizeof(sum), 1, f) == 1;
+}
+
+static bool hashmap_valid_header(const hashmap_file_header_t *header)
+{
+    return memcmp(header->magic, HASHMAP_FILE_MAGIC, sizeof(header->magic)) == 0
+        && header->version == HASHMAP_FILE_VERSION && header->byte_order == HASHMAP_BYTE_ORDER
+        && header->word_size == sizeof(void*) && header->entry_size == sizeof(hashmap_entry_t)
+        && (header->flags & ~(unsigned)(HASHMAP_BOUNDED|HASHMAP_EXPIRING)) == 0
+        && header->capacity <= SIZE_MAX/2/sizeof(hashmap_entry_t) && (header->capacity & (header->capacity - 1)) == 0
+        && header->count <= header->capacity && header->max_count <= header->capacity
+        && header->hand < (header->capacity > 0 ? header->capacity : 1)
+        && header->sweep < (header->capacity > 0 ? header->capacity : 1)
+        && (header->capacity == 0 || header->lastfree < header->capacity);
+}
+
+// Allocate a hash map with the fields from a file header (but no table yet)
+static hashmap_t *hashmap_from_header(const hashmap_file_header_t *header)
+{
+    hashmap_t *h = header->flags ? hashmap_new_extra() : hashmap_new();
+    if (!h) return h;
+    h->flags = header->flags;
+    h->capacity = (size_t)header->capacity;
+    h->count = (size_t)header->count;
+    if (h->extra) {
+        h->extra->max_count = (size_t)header->max_count;
+        h->extra->hand = (size_t)header->hand;
+        h->extra->sweep = (size_t)header->sweep;
+        h->extra->ttl = header->ttl;
+        h->extra->now = header->now;
+        // Expiring entries keep the time they had left when they were saved
+        if (h->flags & HASHMAP_EXPIRING) h->extra->epoch = custom_clock() - header->now;
+    }
+    return h;
+}
+
+hashmap_t *hashmap_load(FILE *f)
+{
+    hashmap_file_header_t header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || !hashmap_valid_header(&header))
+        return NULL;
+
+    hashmap_t *h = hashmap_from_header(&header);
+    if (!h) return h;
+    h->flags |= HASHMAP_TRACE_FLAGS;
+
+    uint64_t sum = checksum(0, &header, sizeof(header));
+    if (h->capacity > 0) {
+        size_t size = hashmap_alloc_size(h, h->capacity);
+        h->entries = custom_alloc(size);
+        if (!h->entries) goto failed;
+        char *table = (char*)h->entries;
+        for (size_t pos = 0; pos < size; pos += HASHMAP_IO_CHUNK) {
+            size_t len = size - pos < HASHMAP_IO_CHUNK ? size - pos : HASHMAP_IO_CHUNK;
+            if (fread(table + pos, 1, len, f) != len) goto failed;
+            sum = checksum(sum, table + pos, len);
+        }
+        h->lastfree = &h->entries[header.lastfree];
+    }
+
+    uint64_t expected;
+    if (fread(&expected, sizeof(expected), 1, f) != 1 || expected != sum) goto failed;
+    return h;
+
+  failed:
+    hashmap_free(&h);
+    return NULL;
+}
+
+// Map a saved (or shared) map file into memory and use its table in place
+static hashmap_t *hashmap_map_fd(int fd, int prot)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(hashmap_file_header_t)) return NULL;
+    void *mapping = mmap(NULL, (size_t)st.st_size, prot, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) return NULL;
+
+    const hashmap_file_header_t *header = mapping;
+    hashmap_t *h = hashmap_valid_header(header) ? hashmap_from_header(header) : NULL;
+    size_t table_size = (h && h->capacity > 0) ? hashmap_alloc_size(h, h->capacity) : 0;
+    if (!h || !hashmap_add_extra(h)
+        || (size_t)st.st_size != sizeof(hashmap_file_header_t) + table_size + sizeof(uint64_t)) {
+        if (h) hashmap_free(&h);
+        (void)munmap(mapping, (size_t)st.st_size);
+        return NULL;
+    }
+
+    h->extra->mapping = mapping;
+    h->extra->mapping_size = (size_t)st.st_size;
+    if (h->capacity > 0) {
+        h->entries = (hashmap_entry_t*)(void*)((char*)mapping + sizeof(hashmap_file_header_t));
+        h->lastfree = &h->entries[header->lastfree];
+    }
+    return h;
+}
+
+hashmap_t *hashmap_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    hashmap_t *h = hashmap_map_fd(fd, PROT_READ);
+    (void)close(fd);
+    if (h) h->flags |= HASHMAP_READONLY;
+    return h;
+}
+
+hashmap_t *hashmap_new_shared(int fd, size_t capacity)
+{
+    if (capacity == 0 || capacity > SIZE_MAX/2/sizeof(hashmap_entry_t)) return NULL;
+    size_t size = 16;
+    while (size < capacity) size *= 2;
+
+    hashmap_file_header_t header = {
+        .magic = HASHMAP_FILE_MAGIC, .version = HASHMAP_FILE_VERSION, .byte_order = HASHMAP_BYTE_ORDER,
+        .word_size = sizeof(void*), .entry_size = sizeof(hashmap_entry_t),
+        .capacity = (uint64_t)size, .lastfree = (uint64_t)size - 1,
+    };
+    // Truncating to zero first makes sure the whole table reads back as zeroes
+    size_t file_size = sizeof(header) + size*sizeof(hashmap_entry_t) + sizeof(uint64_t);
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)file_size) != 0
+        || pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+        return NULL;
+    return hashmap_attach_shared(fd, true);
+}
+
+hashmap_t *hashmap_attach_shared(int fd, bool writer)
+{
+    hashmap_t *h = hashmap_map_fd(fd, writer ? PROT_READ|PROT_WRITE : PROT_READ);
+    if (!h) return h;
+    if (h->flags != 0 || h->capacity == 0) { // Only plain maps can be shared
+        hashmap_free(&h);
+        return NULL;
+    }
+    if (writer) {
+        // The table can't be trusted if the last writer died in the middle of a change
+        hashmap_file_header_t *header = hashmap_shared_header(h);
+        if ((__atomic_load_n(&header->seq, __ATOMIC_ACQUIRE) & 1) && !hashmap_writer_alive(header)) {
+            hashmap_free(&h);
+            return NULL;
+        }
+        __atomic_store_n(&header->writer, (uint64_t)getpid(), __ATOMIC_RELAXED);
+    }
+    h->flags = HASHMAP_SHARED | (writer ? 0 : HASHMAP_READONLY);
+    return h;
+}
+
+// Frozen maps find each key's slot with a minimal perfect hash (see mph.h)
+static inline uint32_t frozen_lookup(hashmap_t *h, const void *key)
+{
+    uint64_t hash = mph_mix((uint64_t)(uintptr_t)key);
+    return mph_slot(hash, h->extra->pilots[mph_bucket(hash, (uint32_t)h->extra->buckets)], (uint32_t)h->count);
+}
+
+static void *hashmap_get_frozen(hashmap_t *h, const void *key)
+{
+    if (h->count > 0) {
+        hashmap_pair_t *pair = &h->extra->pairs[frozen_lookup(h, key)];
+        if (pair->key == key) return pair->value;
+    }
+    if (h->fallback) return hashmap_lookup(h->fallback, key);
+    return NULL;
+}
+
+static const void *hashmap_next_frozen(hashmap_t *h, const void *key)
+{
+    uint32_t i = 0;
+    if (key) {
+        if (h->count == 0) return NULL;
+        i = frozen_lookup(h, key);
+        if (h->extra->pairs[i].key != key) return NULL;
+        ++i;
+    }
+    return i < (uint32_t)h->count ? h->extra->pairs[i].key : NULL;
+}
+
+bool hashmap_freeze(hashmap_t *h)
+{
+    if (h->flags & (HASHMAP_READONLY|HASHMAP_SHARED|HASHMAP_SEGMENTED|HASHMAP_STATIC)) return false;
+    if (!hashmap_add_extra(h)) return false;
+    // Frozen maps have no deadlines, so expired entries are dropped now
+    if ((h->flags & HASHMAP_EXPIRING) && h->capacity > 0) hashmap_tick(h);
+
+    // The perfect hash numbers slots with 32 bits
+    size_t live_count = 0;
+    for (size_t i = 0; i < h->capacity; i++)
+        if (h->entries[i].key && h->entries[i].value && !hashmap_expired(h, &h->entries[i])) ++live_count;
+    if (live_count > UINT32_MAX/2) return false;
+    uint32_t n = (uint32_t)live_count;
+    uint32_t num_buckets = mph_num_buckets(n);
+
+    // Pairs and pilots share one allocation
+    hashmap_pair_t *pairs = custom_alloc(n*sizeof(hashmap_pair_t) + num_buckets*sizeof(uint32_t));
+    if (!pairs) return false;
+    uint32_t *pilots = (uint32_t*)(void*)&pairs[n];
+
+    hashmap_entry_t **live = custom_alloc(n*(sizeof(hashmap_entry_t*) + sizeof(uint64_t) + sizeof(uint32_t)) + 1);
+    bool ok = live != NULL;
+    if (ok) {
+        uint64_t *hashes = (uint64_t*)(void*)&live[n];
+        uint32_t *slots = (uint32_t*)(void*)&hashes[n];
+        size_t j = 0;
+        for (size_t i = 0; i < h->capacity; i++) {
+            hashmap_entry_t *e = &h->entries[i];
+            if (!e->key || !e->value || hashmap_expired(h, e)) continue;
+            live[j] = e;
+            hashes[j] = mph_mix((uint64_t)(uintptr_t)e->key);
+            ++j;
+        }
+        ok = mph_build(hashes, n, pilots, slots);
+        for (uint32_t k = 0; k < n && ok; k++) {
+            pairs[slots[k]].key = live[k]->key;
+            pairs[slots[k]].value = live[k]->value;
+        }
+    }
+    if (live && custom_free) custom_free(live);
+    if (!ok) {
+        if (custom_free) custom_free(pairs);
+        return false;
+    }
+
+    hashmap_extra_t *x = h->extra;
+    if (x->mapping) (void)munmap(x->mapping, x->mapping_size);
+    else if (h->entries && custom_free) custom_free(h->entries);
+    memset(x, 0, sizeof(hashmap_extra_t));
+    h->entries = h->lastfree = NULL;
+    h->capacity = 0;
+    h->count = n;
+    h->flags = HASHMAP_FROZEN | HASHMAP_READONLY;
+    x->pairs = pairs;
+    x->pilots = pilots;
+    x->buckets = (int)num_buckets;
+    return true;
+}
 // vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1
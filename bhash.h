@@ -7,31 +7,136 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
 //////////////////////////////////////////////////////
 ////////////////    Hash Maps     ////////////////////
 //////////////////////////////////////////////////////
 
-typedef struct hashmap_entry_s {
+typedef struct {
     const void *key;
     void *value;
-    struct hashmap_entry_s *next;
+    // Offset to the next entry in this entry's chain (0 for none). On 64-bit
+    // platforms this takes the space that would otherwise be padding, so links
+    // can span tables of any size at no cost.
+    ptrdiff_t next;
 } hashmap_entry_t;
 
+typedef struct {
+    const void *key;
+    void *value;
+} hashmap_pair_t;
+
+// Hash map mode flags
+#define HASHMAP_BOUNDED  0x1 // Fixed-capacity cache with CLOCK eviction
+#define HASHMAP_EXPIRING 0x2 // Entries expire after a time-to-live
+#define HASHMAP_READONLY 0x4 // Read-only view of a memory-mapped file
+#define HASHMAP_SHARED   0x8 // Fixed-capacity table in memory shared between processes
+#define HASHMAP_FROZEN   0x10 // Immutable map indexed by a minimal perfect hash
+#define HASHMAP_LINEAR   0x20 // Grows by splitting one bucket at a time (linear hashing)
+#define HASHMAP_SEGMENTED 0x40 // Directory of subtables that resize independently
+#define HASHMAP_STATIC   0x80 // Fixed-capacity table in caller-supplied memory
+#define HASHMAP_TRACED   0x100 // Set by a traced library so lookups always reach it
+
+// State for the special modes below, kept in a separate allocation so that
+// plain maps (and maps embedded in other structs) only need a small header.
+// Per-slot metadata (expiry deadlines, then CLOCK reference bits) is stored
+// after the entries, in the same allocation as the table.
+typedef struct {
+    // Bounded caches: entry limit and CLOCK hand
+    size_t max_count, hand;
+    // Expiring maps: default TTL, the current time (in ms since `epoch`), and
+    // the expiry sweeper's position
+    uint32_t ttl, now;
+    uint64_t epoch;
+    size_t sweep;
+    // Views, shared maps and linear maps: the memory mapping holding the table
+    void *mapping;
+    size_t mapping_size;
+    // Frozen maps: `count` key/value pairs and one pilot per bucket
+    hashmap_pair_t *pairs;
+    uint32_t *pilots;
+    int buckets;
+    // Linear maps: buckets below `split` are addressed with one more hash bit
+    // than the `level` buckets above them
+    size_t level, split;
+    // Segmented maps: a directory of 2^depth subtables picked by the top bits
+    // of a remixed hash (`capacity` counts the slots of every subtable). Each
+    // subtable's own `depth` is how many of those bits all of its keys share.
+    struct hashmap_s **segments;
+    unsigned int depth;
+} hashmap_extra_t;
+
+// Everything a lookup or insertion in a plain map uses fits in one cache line
 typedef struct hashmap_s {
     hashmap_entry_t *entries, *lastfree;
     struct hashmap_s *fallback;
-    int capacity, count;
+    size_t capacity, count;
+    unsigned int flags;
+    hashmap_extra_t *extra; // NULL for plain maps and static maps
 } hashmap_t;
 
-// Set custom allocator/freer
+// Set custom allocator/freer (linear maps' tables are memory-mapped instead)
 __attribute__((nonnull(1)))
 void hashmap_set_allocator(void *(*alloc)(size_t), void (*free)(void*));
 
+// Set the millisecond clock used by expiring maps (NULL for CLOCK_MONOTONIC)
+void hashmap_set_clock(uint64_t (*now_ms)(void));
+
 // Allocate a new hash map
 __attribute__((warn_unused_result))
 hashmap_t *hashmap_new(void);
+// Initialize an empty map in caller-owned storage (e.g. a field of another
+// struct), which is the same as assigning HASHMAP_INIT. Its tables are still
+// allocated as needed, so release them with hashmap_destroy(), not
+// hashmap_free().
+#ifdef __cplusplus
+#define HASHMAP_INIT {}
+#else
+#define HASHMAP_INIT {0}
+#endif
+__attribute__((nonnull))
+void hashmap_init(hashmap_t *h);
+// Allocate a cache that holds at most `max_count` entries. The table is sized
+// up front and never resized: inserting a new key into a full cache evicts a
+// not-recently-used entry (CLOCK algorithm) and hashmap_pop() removes entries
+// outright, so keys must not be popped while iterating with hashmap_next().
+__attribute__((warn_unused_result))
+hashmap_t *hashmap_new_cache(size_t max_count);
+// Allocate a map whose entries expire `ttl_ms` milliseconds after they are
+// last set (at most ~24 days). Expired entries are reclaimed lazily when they
+// are looked up and by a sweeper that checks a couple of slots per operation.
+// Like caches, popping removes entries outright.
+__attribute__((warn_unused_result))
+hashmap_t *hashmap_new_expiring(uint32_t ttl_ms);
+// Allocate a map that grows by linear hashing: instead of rehashing the whole
+// table when it fills up, each insertion that takes the table past 3/4 full
+// splits one bucket into a new slot at the end of the table. Every insertion
+// does a small, bounded amount of work, and memory grows a slot at a time.
+// Setting a NULL value removes the entry outright, so keys must not be popped
+// while iterating with hashmap_next(). If the table is full and growing it
+// fails, hashmap_set() stores nothing and returns HASHMAP_FULL. Linear maps
+// can't be saved.
+__attribute__((warn_unused_result))
+hashmap_t *hashmap_new_linear(void);
+// Allocate a map for very large numbers of entries, split into subtables of at
+// most 64K slots that each resize on their own. A subtable that fills up is
+// split in two by one more bit of the hash (extendible hashing), so no
+// allocation or rehash ever involves more than one subtable's worth of
+// entries. Segmented maps can't be saved or frozen.
+__attribute__((warn_unused_result))
+hashmap_t *hashmap_new_segmented(void);
+// Initialize a map in caller-supplied memory: `h` and a buffer of `capacity`
+// entries (at least 2), which the map uses for as long as it exists. The map
+// never allocates or frees memory, so it is safe to use where malloc() isn't.
+// It never grows: when every slot is in use, hashmap_set() stores nothing and
+// returns HASHMAP_FULL, and popping a key frees its slot. Chains can use every
+// slot, so the table works even when completely full. Static maps need no
+// cleanup (don't pass them to hashmap_free()), and can't be saved or frozen.
+__attribute__((nonnull))
+bool hashmap_init_static(hashmap_t *h, hashmap_entry_t *buffer, size_t capacity);
 // Copy a hash map
 __attribute__((warn_unused_result))
 hashmap_t *hashmap_copy(hashmap_t *h);
@@ -41,9 +146,14 @@ size_t hashmap_length(hashmap_t *h);
 // Retrieve a value from a hash map (or return NULL) if not found
 __attribute__((nonnull,warn_unused_result))
 void *hashmap_get(hashmap_t *h, const void *key);
-// Store a key/value pair in the hash map and return the previous value (if any)
+// Store a key/value pair in the hash map and return the previous value (if any),
+// or HASHMAP_FULL if the key is new and a shared or static map has no room for
+// it (or a linear map is full and couldn't get memory to grow)
 __attribute__((nonnull(1,2)))
 void *hashmap_set(hashmap_t *h, const void *key, const void *value);
+// Store a key/value pair with its own time-to-live (same as hashmap_set() for non-expiring maps)
+__attribute__((nonnull(1,2)))
+void *hashmap_set_ttl(hashmap_t *h, const void *key, const void *value, uint32_t ttl_ms);
 // Get the key after the given key (or NULL to get the first key)
 __attribute__((nonnull(1),warn_unused_result))
 const void *hashmap_next(hashmap_t *h, const void *key);
@@ -53,7 +163,130 @@ void hashmap_clear(hashmap_t *h);
 // Deallocate the memory associated with the hash map (individual entries are not freed)
 __attribute__((nonnull))
 void hashmap_free(hashmap_t **h);
+// Deallocate a map initialized with hashmap_init() or hashmap_init_static()
+// (but not the hashmap_t itself), leaving it empty and ready to reuse
+__attribute__((nonnull))
+void hashmap_destroy(hashmap_t *h);
+// Convert a map into an immutable form where each key has exactly one possible
+// slot (a minimal perfect hash), so lookups make a single probe and each entry
+// takes about as much memory as its key and value. Afterwards hashmap_get(),
+// hashmap_next(), hashmap_length() and hashmap_copy() work as usual, but
+// modifications do nothing. Freezing an expiring map drops the entries that
+// have expired, and the rest never expire afterwards. Returns false (leaving
+// the map unchanged) if the map is a view, shared map, segmented map or static
+// map, or if memory runs out.
+__attribute__((nonnull))
+bool hashmap_freeze(hashmap_t *h);
+// Write a map's table to a file verbatim. Keys and values are saved as raw
+// pointer-sized integers, so this is only meaningful for maps whose keys and
+// values are numbers (or otherwise valid across processes). The fallback map
+// is not saved. Views and a shared map's writer are saved as ordinary maps
+// that hashmap_load() reads back. Returns false on write errors (or if the map
+// is frozen, linear, segmented, static or a shared map's reader).
+__attribute__((nonnull,warn_unused_result))
+bool hashmap_save(hashmap_t *h, FILE *f);
+// Read a map written by hashmap_save() (no rehashing is needed). Returns NULL
+// if the file is truncated, corrupted, or was saved by an incompatible build.
+__attribute__((nonnull,warn_unused_result))
+hashmap_t *hashmap_load(FILE *f);
+// Memory-map a file written by hashmap_save() as a read-only view. Lookups and
+// iteration run directly against the mapped table, so startup takes constant
+// time and processes that open the same file share one copy in the page
+// cache. Modifying a view does nothing. The checksum is not verified (use
+// hashmap_load() for that). Returns NULL if the file can't be mapped.
+__attribute__((nonnull,warn_unused_result))
+hashmap_t *hashmap_open(const char *path);
+// Create a map with room for `capacity` entries in a file or memfd (which is
+// truncated) so it can be shared between processes. The returned map is the
+// writer. Shared maps never grow: hashmap_set() stores nothing and returns
+// HASHMAP_FULL when the table is full, and popping a key frees its slot for reuse.
+__attribute__((warn_unused_result))
+hashmap_t *hashmap_new_shared(int fd, size_t capacity);
+// Attach to a shared map created by hashmap_new_shared(). Only one process
+// may be the writer at a time. Readers may look keys up with hashmap_get()
+// while the writer is updating the map (lookups retry if they overlap a
+// write), but iterating with hashmap_next() is only consistent while the
+// writer is idle. If the writer process dies in the middle of a change,
+// lookups return NULL instead of waiting for it forever, and attaching a new
+// writer fails (the map has to be created again).
+__attribute__((warn_unused_result))
+hashmap_t *hashmap_attach_shared(int fd, bool writer);
 
 #define hashmap_pop(h, key) hashmap_set(h, key, NULL)
 
+// Returned by hashmap_set() when a shared or static map is full
+extern char hashmap_full;
+#define HASHMAP_FULL ((void*)&hashmap_full)
+
+//////////////////////////////////////////////////////
+////////////////   Byte Hashing   ////////////////////
+//////////////////////////////////////////////////////
+
+// Hash a string of bytes (e.g. for keying maps by content). The fastest
+// implementation the CPU supports (AES-NI, SSE4.2 CRC32C, or portable C) is
+// chosen when the library is loaded, so hashes differ between machines and
+// should not be saved.
+__attribute__((warn_unused_result))
+uint64_t bhash_hash_bytes(const void *data, size_t len);
+// Get the name of the byte hasher in use ("aes", "crc32c" or "portable")
+__attribute__((warn_unused_result))
+const char *bhash_byte_hasher(void);
+// Switch to a byte hasher by name (or the fastest supported one for NULL).
+// Returns false if the CPU doesn't support it. The switch is atomic, so it is
+// safe while other threads are hashing, but it invalidates every existing map
+// whose keys were hashed with the old hasher: those maps must not be used
+// until they are rebuilt, so it's best to switch before building any.
+bool bhash_use_byte_hasher(const char *name);
+
+// The hash used to pick a key's slot in the table
+static inline size_t bhash_hash_pointer(const void *p)
+{
+    size_t s = (size_t)p;
+    if (s == 0) return 1234567;
+    return (s >> 5) | (s << (8*sizeof(void*) - 5));
+}
+
+// Lookups in plain maps (no mode flags) are done inline in the caller, so the
+// common case doesn't pay for a call into the shared library. Caches, expiring
+// maps, linear, segmented and static maps, views, shared maps and frozen maps
+// go through the library's hashmap_get(), and so does every map of a library
+// built with -DBHASH_TRACE (which sets HASHMAP_TRACED on them). Define
+// BHASH_NO_INLINE before including this header to always call the library.
+__attribute__((nonnull,warn_unused_result))
+static inline void *hashmap_get_inline(hashmap_t *h, const void *key)
+{
+    if (__builtin_expect(h->flags == 0 && h->capacity > 0, 1)) {
+        const hashmap_entry_t *e = &h->entries[bhash_hash_pointer(key) & (size_t)(h->capacity-1)];
+        for (;;) {
+            if (e->key == key) return e->value;
+            if (!e->next) break;
+            e += e->next;
+        }
+        return h->fallback ? (hashmap_get)(h->fallback, key) : NULL;
+    }
+    return (hashmap_get)(h, key);
+}
+
+#if !defined(BHASH_NO_INLINE) && !defined(BHASH_TRACE)
+#define hashmap_get(h, key) hashmap_get_inline(h, key)
+#endif
+
+// When the library is built with -DBHASH_TRACE and $BHASH_TRACE_FILE is set,
+// every hashmap_get(), hashmap_set(), hashmap_next(), hashmap_clear() and
+// hashmap_free() call is appended to that file (including inline lookups in
+// programs compiled without -DBHASH_TRACE), for replaying with
+// bhash-replay. The file is HASHMAP_TRACE_MAGIC followed by records of two
+// uint32_t's: the operation, HASHMAP_TRACE_NULL if the value (for hashmap_set()
+// and hashmap_get()) or key (for hashmap_next()) was NULL, and the map's number
+// shifted by HASHMAP_TRACE_MAP_SHIFT; then the key's number (0 for NULL). Maps
+// and keys are numbered from 1 in order of first appearance. Tracing is not
+// thread-safe.
+typedef enum {
+    HASHMAP_TRACE_GET, HASHMAP_TRACE_SET, HASHMAP_TRACE_NEXT, HASHMAP_TRACE_CLEAR, HASHMAP_TRACE_FREE,
+} hashmap_trace_op_t;
+#define HASHMAP_TRACE_MAGIC "bhtrace1"
+#define HASHMAP_TRACE_OP_MASK 0x7
+#define HASHMAP_TRACE_NULL 0x8
+#define HASHMAP_TRACE_MAP_SHIFT 4
+
 // vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1
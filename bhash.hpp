@@ -0,0 +1,609 @@
+// bhash.hpp - C++ Hash Map Template
+// Copyright 2022 Bruce Hill
+// Provided under the MIT license with the Commons Clause
+// See included LICENSE for details.
+
+// bhash::map<K,V> is a header-only C++17 version of the hash map in bhash.c.
+// It uses the same chained scatter table with Brent's variation, but keys and
+// values are stored inline in the table with their real types, and hashing
+// and equality are template parameters, so lookups compile down to a few
+// inlined instructions with no calls into the library.
+// See README.md for more details.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace bhash {
+
+// Hash functions for the common key types. Only the low bits of a hash are
+// used to pick a slot, so every hash here mixes high bits down into low bits.
+template <class K, class Enable = void>
+struct hash;
+
+template <class K>
+struct hash<K, std::enable_if_t<std::is_integral_v<K> || std::is_enum_v<K>>> {
+    size_t operator()(K key) const noexcept {
+        uint64_t x = (uint64_t)key * 0x9E3779B97F4A7C15u;
+        return (size_t)(x ^ (x >> 32));
+    }
+};
+
+// The same hash as hash_pointer() in bhash.c
+template <class T>
+struct hash<T*, void> {
+    size_t operator()(T *key) const noexcept {
+        size_t s = (size_t)key;
+        if (s == 0) return 1234567;
+        return (s >> 5) | (s << (8*sizeof(void*) - 5));
+    }
+};
+
+template <>
+struct hash<std::string_view, void> {
+    size_t operator()(std::string_view key) const noexcept {
+        // FNV-1a, folded so the high bits affect the slot
+        uint64_t h = 0xCBF29CE484222325u;
+        for (char c : key) {
+            h ^= (unsigned char)c;
+            h *= 0x100000001B3u;
+        }
+        return (size_t)(h ^ (h >> 32));
+    }
+};
+
+template <>
+struct hash<std::string, void> : hash<std::string_view, void> {};
+
+template <class K, class V, class Hash = hash<K>, class KeyEqual = std::equal_to<K>,
+          class Allocator = std::allocator<std::pair<const K, V>>>
+class map {
+public:
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = std::pair<const K, V>;
+    using size_type = size_t;
+    using difference_type = ptrdiff_t;
+    using hasher = Hash;
+    using key_equal = KeyEqual;
+    using allocator_type = Allocator;
+    using reference = value_type&;
+    using const_reference = const value_type&;
+
+private:
+    struct slot {
+        union { value_type kv; };
+        int32_t next; // Offset to the next slot in the chain (0 for the end)
+        bool used;
+        slot() noexcept : next(0), used(false) {}
+        ~slot() {}
+    };
+
+    using slot_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<slot>;
+    using slot_traits = std::allocator_traits<slot_allocator>;
+    // Keys and values are constructed through the allocator, like in the
+    // standard containers, so e.g. a pmr map's strings use the map's resource
+    using value_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<value_type>;
+    using value_traits = std::allocator_traits<value_allocator>;
+
+    // Chain links are 32-bit offsets, like BHASH_DEFINE() maps, which limits
+    // a table to 2^30 slots
+    static constexpr size_t max_slots = (size_t)1 << 30;
+
+    // Entries move around as chains are rearranged, and values that are
+    // trivially copyable can be moved with a plain memcpy
+    static constexpr bool trivial_relocate = std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V>;
+
+    slot *slots = nullptr;
+    size_t capacity = 0, count = 0;
+    size_t lastfree = 0; // Slots at or above this index are known to be in use
+    Hash hash_fn;
+    KeyEqual key_eq;
+    slot_allocator alloc;
+
+    size_t main_index(const K &key) const noexcept { return hash_fn(key) & (capacity - 1); }
+
+    static slot *next_slot(slot *s) noexcept { return s->next ? s + s->next : nullptr; }
+    static void link(slot *s, slot *next) noexcept { s->next = next ? (int32_t)(next - s) : 0; }
+
+    template <class... Args>
+    void construct(slot *s, Args&&... args) {
+        value_allocator a(alloc);
+        value_traits::construct(a, &s->kv, std::forward<Args>(args)...);
+    }
+
+    // Move an entry's key and value from one slot to another (not its link)
+    void relocate(slot *dest, slot *src) {
+        if constexpr (trivial_relocate) {
+            std::memcpy((void*)&dest->kv, (const void*)&src->kv, sizeof(value_type));
+        } else {
+            construct(dest, std::move(const_cast<K&>(src->kv.first)), std::move(src->kv.second));
+            destroy(src);
+        }
+        dest->used = true;
+        src->used = false;
+    }
+
+    void destroy(slot *s) noexcept {
+        if constexpr (!std::is_trivially_destructible_v<value_type>) {
+            value_allocator a(alloc);
+            value_traits::destroy(a, &s->kv);
+        }
+        s->used = false;
+    }
+
+    slot *allocate(size_t n) {
+        slot *s = slot_traits::allocate(alloc, n);
+        for (size_t i = 0; i < n; i++)
+            slot_traits::construct(alloc, &s[i]);
+        return s;
+    }
+
+    void release() noexcept {
+        if (!slots) return;
+        for (size_t i = 0; i < capacity; i++)
+            if (slots[i].used) destroy(&slots[i]);
+        slot_traits::deallocate(alloc, slots, capacity);
+        slots = nullptr;
+        capacity = count = lastfree = 0;
+    }
+
+    // Look up `key`, also returning its main slot index for unlinking
+    slot *find_slot(const K &key, size_t *main = nullptr) const noexcept {
+        if (capacity == 0) return nullptr;
+        size_t i = main_index(key);
+        if (main) *main = i;
+        for (slot *s = &slots[i]; s && s->used; s = next_slot(s)) {
+            if (key_eq(s->kv.first, key))
+                return s;
+        }
+        return nullptr;
+    }
+
+    // Find the slot holding `key`, or claim and link an empty slot where it
+    // belongs (returned with `used` still false for the caller to construct)
+    std::pair<slot*, bool> find_or_claim(const K &key) {
+        if (capacity == 0) rehash(16);
+        for (;;) {
+            size_t i = main_index(key);
+            slot *collision = &slots[i];
+            if (!collision->used) {
+                collision->next = 0;
+                return {collision, true};
+            }
+
+            size_t i2 = main_index(collision->kv.first);
+            if (i2 == i) { // Hit a node in the correct place
+                for (slot *s = collision; s; s = next_slot(s)) {
+                    if (key_eq(s->kv.first, key))
+                        return {s, false};
+                }
+            }
+
+            // Find a free space to insert, wrapping around to reuse erased
+            // slots while the table is less than 3/4 full
+            while (lastfree > 0 && slots[lastfree-1].used)
+                --lastfree;
+            if (lastfree == 0 && count < capacity - capacity/4) {
+                lastfree = capacity;
+                while (slots[lastfree-1].used)
+                    --lastfree;
+            }
+            if (lastfree == 0) { // No spaces left, gotta resize and try again
+                rehash(2*capacity);
+                continue;
+            }
+
+            slot *empty = &slots[lastfree-1];
+            if (i2 == i) {
+                // Put the new node between the colliding node and the second node in the chain
+                link(empty, next_slot(collision));
+                link(collision, empty);
+                return {empty, true};
+            }
+            // Hit the middle of a chain for some other hash value: scootch the
+            // collider to the empty slot and take its slot
+            slot *prev = &slots[i2];
+            while (next_slot(prev) != collision)
+                prev = next_slot(prev);
+            relocate(empty, collision);
+            link(empty, next_slot(collision));
+            link(prev, empty);
+            collision->next = 0;
+            return {collision, true};
+        }
+    }
+
+    // Unlink a slot from its chain (its contents must already be destroyed or
+    // never constructed) and make it available for reuse. Returns the slot
+    // that was freed, which differs from `e` when the next entry in the chain
+    // is pulled up into `e`.
+    slot *unlink(slot *e, size_t main) noexcept {
+        slot *head = &slots[main], *freed = e;
+        if (e == head) { // Chain head: pull the second node up into this slot
+            if (e->next) {
+                freed = next_slot(e);
+                relocate(e, freed);
+                link(e, next_slot(freed));
+            }
+        } else {
+            slot *prev = head;
+            while (next_slot(prev) != e)
+                prev = next_slot(prev);
+            link(prev, next_slot(e));
+        }
+        freed->used = false;
+        freed->next = 0;
+        // Hand the freed slot to the next insertion that needs one
+        lastfree = (size_t)(freed - slots) + 1;
+        return freed;
+    }
+
+    // Insert a value constructed from `args` unless `key` is already present,
+    // with a single probe. The key is only copied or moved if it is inserted.
+    template <class KK, class... Args>
+    std::pair<slot*, bool> emplace_key(KK &&key, Args&&... args) {
+        auto [s, inserted] = find_or_claim(key);
+        if (!inserted) return {s, false};
+        size_t main = main_index(key);
+        try {
+            construct(s, std::piecewise_construct, std::forward_as_tuple(std::forward<KK>(key)),
+                      std::forward_as_tuple(std::forward<Args>(args)...));
+        } catch (...) {
+            unlink(s, main);
+            throw;
+        }
+        s->used = true;
+        ++count;
+        return {s, true};
+    }
+
+    // Copy or move every entry of another map, slot for slot, so the chains stay the same
+    template <class Other>
+    void copy_slots(Other &&other) {
+        if (other.capacity == 0) return;
+        slots = allocate(other.capacity);
+        capacity = other.capacity;
+        lastfree = other.lastfree;
+        try {
+            for (size_t i = 0; i < capacity; i++) {
+                slots[i].next = other.slots[i].next;
+                if (!other.slots[i].used) continue;
+                if constexpr (std::is_lvalue_reference_v<Other>)
+                    construct(&slots[i], other.slots[i].kv);
+                else
+                    construct(&slots[i], std::move(const_cast<K&>(other.slots[i].kv.first)),
+                              std::move(other.slots[i].kv.second));
+                slots[i].used = true;
+                ++count;
+            }
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    template <bool Const>
+    class iter {
+        friend class map;
+        template <bool> friend class iter;
+        using slot_ptr = std::conditional_t<Const, const slot*, slot*>;
+        slot_ptr s = nullptr, end = nullptr;
+
+        iter(slot_ptr start, slot_ptr stop) noexcept : s(start), end(stop) { skip(); }
+        void skip() noexcept {
+            while (s != end && !s->used) ++s;
+        }
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = map::value_type;
+        using difference_type = ptrdiff_t;
+        using pointer = std::conditional_t<Const, const value_type*, value_type*>;
+        using reference = std::conditional_t<Const, const value_type&, value_type&>;
+
+        iter() noexcept = default;
+        template <bool C = Const, class = std::enable_if_t<C>>
+        iter(const iter<false> &other) noexcept : s(other.s), end(other.end) {}
+
+        reference operator*() const noexcept { return s->kv; }
+        pointer operator->() const noexcept { return &s->kv; }
+        iter &operator++() noexcept {
+            ++s;
+            skip();
+            return *this;
+        }
+        iter operator++(int) noexcept {
+            iter prev = *this;
+            ++*this;
+            return prev;
+        }
+        template <bool C>
+        bool operator==(const iter<C> &other) const noexcept { return s == other.s; }
+        template <bool C>
+        bool operator!=(const iter<C> &other) const noexcept { return s != other.s; }
+    };
+
+public:
+    // Iterators visit entries in slot order. Inserting may move entries to
+    // other slots, so it invalidates all iterators; erasing only invalidates
+    // the erased position.
+    using iterator = iter<false>;
+    using const_iterator = iter<true>;
+
+    // A key and value removed from a map with extract(), which can be
+    // modified and inserted into another map with the same key and value types
+    class node_type {
+        friend class map;
+        std::optional<std::pair<K, V>> kv;
+        explicit node_type(std::pair<K, V> &&contents) : kv(std::move(contents)) {}
+
+    public:
+        node_type() = default;
+        bool empty() const noexcept { return !kv; }
+        explicit operator bool() const noexcept { return kv.has_value(); }
+        K &key() noexcept { return kv->first; }
+        V &mapped() noexcept { return kv->second; }
+    };
+
+    struct insert_return_type {
+        iterator position;
+        bool inserted;
+        node_type node;
+    };
+
+    map() = default;
+    explicit map(const Allocator &a) : alloc(a) {}
+    explicit map(size_t n, const Allocator &a = Allocator()) : alloc(a) { reserve(n); }
+
+    map(const map &other)
+        : hash_fn(other.hash_fn), key_eq(other.key_eq),
+          alloc(slot_traits::select_on_container_copy_construction(other.alloc)) {
+        copy_slots(other);
+    }
+
+    map(const map &other, const Allocator &a) : hash_fn(other.hash_fn), key_eq(other.key_eq), alloc(a) {
+        copy_slots(other);
+    }
+
+    map(map &&other) noexcept
+        : slots(other.slots), capacity(other.capacity), count(other.count), lastfree(other.lastfree),
+          hash_fn(std::move(other.hash_fn)), key_eq(std::move(other.key_eq)), alloc(std::move(other.alloc)) {
+        other.slots = nullptr;
+        other.capacity = other.count = other.lastfree = 0;
+    }
+
+    map &operator=(const map &other) {
+        if (this == &other) return *this;
+        release();
+        hash_fn = other.hash_fn;
+        key_eq = other.key_eq;
+        if constexpr (slot_traits::propagate_on_container_copy_assignment::value)
+            alloc = other.alloc;
+        copy_slots(other);
+        return *this;
+    }
+
+    map &operator=(map &&other) noexcept(slot_traits::propagate_on_container_move_assignment::value
+                                         || slot_traits::is_always_equal::value) {
+        if (this == &other) return *this;
+        release();
+        hash_fn = std::move(other.hash_fn);
+        key_eq = std::move(other.key_eq);
+        if constexpr (slot_traits::propagate_on_container_move_assignment::value)
+            alloc = std::move(other.alloc);
+        if (slot_traits::propagate_on_container_move_assignment::value || alloc == other.alloc) {
+            std::swap(slots, other.slots);
+            std::swap(capacity, other.capacity);
+            std::swap(count, other.count);
+            std::swap(lastfree, other.lastfree);
+        } else { // Different memory resources: the entries have to be moved one by one
+            copy_slots(std::move(other));
+            other.release();
+        }
+        return *this;
+    }
+
+    ~map() { release(); }
+
+    // Like the standard containers, swapping maps whose allocators are
+    // unequal and don't propagate is not allowed
+    void swap(map &other) noexcept {
+        std::swap(slots, other.slots);
+        std::swap(capacity, other.capacity);
+        std::swap(count, other.count);
+        std::swap(lastfree, other.lastfree);
+        std::swap(hash_fn, other.hash_fn);
+        std::swap(key_eq, other.key_eq);
+        if constexpr (slot_traits::propagate_on_container_swap::value)
+            std::swap(alloc, other.alloc);
+    }
+
+    allocator_type get_allocator() const noexcept { return allocator_type(alloc); }
+
+    size_t size() const noexcept { return count; }
+    bool empty() const noexcept { return count == 0; }
+    size_t bucket_count() const noexcept { return capacity; }
+
+    iterator begin() noexcept { return iterator(slots, slots + capacity); }
+    iterator end() noexcept { return iterator(slots + capacity, slots + capacity); }
+    const_iterator begin() const noexcept { return const_iterator(slots, slots + capacity); }
+    const_iterator end() const noexcept { return const_iterator(slots + capacity, slots + capacity); }
+    const_iterator cbegin() const noexcept { return begin(); }
+    const_iterator cend() const noexcept { return end(); }
+
+    // Rebuild the table with `n` slots (rounded up to a power of two that can
+    // hold every entry). Throws std::length_error past 2^30 slots.
+    void rehash(size_t n) {
+        if (n > max_slots || count > max_slots) throw std::length_error("bhash::map: too many slots");
+        size_t new_capacity = 16;
+        while (new_capacity < n || new_capacity < count) new_capacity *= 2;
+        slot *old_slots = slots;
+        size_t old_capacity = capacity;
+        slots = allocate(new_capacity);
+        capacity = lastfree = new_capacity;
+        count = 0;
+        for (size_t i = 0; i < old_capacity; i++) {
+            slot *e = &old_slots[i];
+            if (!e->used) continue;
+            slot *s = find_or_claim(e->kv.first).first;
+            relocate(s, e);
+            ++count;
+        }
+        if (old_slots) slot_traits::deallocate(alloc, old_slots, old_capacity);
+    }
+
+    void reserve(size_t n) {
+        if (n > capacity) rehash(n);
+    }
+
+    void clear() noexcept { release(); }
+
+    V *get(const K &key) noexcept {
+        slot *s = find_slot(key);
+        return s ? &s->kv.second : nullptr;
+    }
+
+    const V *get(const K &key) const noexcept {
+        slot *s = find_slot(key);
+        return s ? &s->kv.second : nullptr;
+    }
+
+    iterator find(const K &key) noexcept {
+        slot *s = find_slot(key);
+        return s ? iterator(s, slots + capacity) : end();
+    }
+
+    const_iterator find(const K &key) const noexcept {
+        slot *s = find_slot(key);
+        return s ? const_iterator(s, slots + capacity) : end();
+    }
+
+    bool contains(const K &key) const noexcept { return find_slot(key) != nullptr; }
+
+    // Insert a value constructed from `args` if `key` isn't already present.
+    // Returns the key's value and whether it was inserted.
+    template <class... Args>
+    std::pair<V*, bool> emplace(const K &key, Args&&... args) {
+        auto [s, inserted] = emplace_key(key, std::forward<Args>(args)...);
+        return {&s->kv.second, inserted};
+    }
+
+    // The same as emplace(), but with the standard library's signature. If
+    // the key is already present, neither `key` nor `args` are moved from.
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(const K &key, Args&&... args) {
+        auto [s, inserted] = emplace_key(key, std::forward<Args>(args)...);
+        return {iterator(s, slots + capacity), inserted};
+    }
+
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(K &&key, Args&&... args) {
+        auto [s, inserted] = emplace_key(std::move(key), std::forward<Args>(args)...);
+        return {iterator(s, slots + capacity), inserted};
+    }
+
+    // Insert or overwrite the value for `key`. Returns true if the key is new.
+    template <class M>
+    bool set(const K &key, M &&value) {
+        auto [s, inserted] = emplace_key(key, std::forward<M>(value));
+        if (!inserted) s->kv.second = std::forward<M>(value);
+        return inserted;
+    }
+
+    template <class M>
+    std::pair<iterator, bool> insert_or_assign(K &&key, M &&value) {
+        auto [s, inserted] = emplace_key(std::move(key), std::forward<M>(value));
+        if (!inserted) s->kv.second = std::forward<M>(value);
+        return {iterator(s, slots + capacity), inserted};
+    }
+
+    template <class M>
+    std::pair<iterator, bool> insert_or_assign(const K &key, M &&value) {
+        auto [s, inserted] = emplace_key(key, std::forward<M>(value));
+        if (!inserted) s->kv.second = std::forward<M>(value);
+        return {iterator(s, slots + capacity), inserted};
+    }
+
+    V &operator[](const K &key) { return emplace_key(key).first->kv.second; }
+    V &operator[](K &&key) { return emplace_key(std::move(key)).first->kv.second; }
+
+    // Remove `key` and its value from the table. Returns true if it was present.
+    bool erase(const K &key) {
+        size_t main;
+        slot *s = find_slot(key, &main);
+        if (!s) return false;
+        destroy(s);
+        unlink(s, main);
+        --count;
+        return true;
+    }
+
+    // Remove the entry at `pos` and return an iterator to the next entry, so
+    // erasing while iterating visits every remaining entry exactly once
+    iterator erase(const_iterator pos) {
+        slot *s = const_cast<slot*>(pos.s);
+        size_t main = main_index(s->kv.first);
+        destroy(s);
+        slot *freed = unlink(s, main);
+        --count;
+        // If a later entry was pulled up into this slot, it hasn't been visited yet
+        if (freed > s) return iterator(s, slots + capacity);
+        return iterator(s + 1, slots + capacity);
+    }
+
+    // Move the entry for `key` out of the map, with a single probe
+    node_type extract(const K &key) {
+        size_t main;
+        slot *s = find_slot(key, &main);
+        if (!s) return node_type();
+        node_type node(std::pair<K, V>(std::move(const_cast<K&>(s->kv.first)), std::move(s->kv.second)));
+        destroy(s);
+        unlink(s, main);
+        --count;
+        return node;
+    }
+
+    insert_return_type insert(node_type &&node) {
+        if (!node) return {end(), false, node_type()};
+        auto [s, inserted] = emplace_key(std::move(node.key()), std::move(node.mapped()));
+        if (!inserted) return {iterator(s, slots + capacity), false, std::move(node)};
+        node.kv.reset();
+        return {iterator(s, slots + capacity), true, node_type()};
+    }
+
+    // Call f(key, value) for every entry
+    template <class F>
+    void for_each(F &&f) {
+        for (auto &kv : *this) f(kv.first, kv.second);
+    }
+
+    template <class F>
+    void for_each(F &&f) const {
+        for (const auto &kv : *this) f(kv.first, kv.second);
+    }
+};
+
+// Maps that allocate from a std::pmr::memory_resource, e.g. a per-request
+// std::pmr::monotonic_buffer_resource
+namespace pmr {
+template <class K, class V, class Hash = hash<K>, class KeyEqual = std::equal_to<K>>
+using map = bhash::map<K, V, Hash, KeyEqual, std::pmr::polymorphic_allocator<std::pair<const K, V>>>;
+}
+
+} // namespace bhash
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1
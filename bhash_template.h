@@ -0,0 +1,267 @@
+// bhash_template.h - Type-Specialized C Hash Maps
+// Copyright 2022 Bruce Hill
+// Provided under the MIT license with the Commons Clause
+// See included LICENSE for details.
+
+// BHASH_DEFINE(name, key_t, value_t, hash, equal) defines a hash map type
+// `name_t` with keys and values of the given types stored inline in its
+// entry array, and static functions to operate on it. It uses the same
+// chained scatter table with Brent's variation as bhash.c, but with no void*
+// boxing and no calls into the library, so the compiler can specialize
+// everything and inline lookups (the bigger insertion and removal functions
+// are plain static functions that it may inline or not). `hash` must be a
+// function or macro taking a key_t and returning an integer with well-mixed
+// low bits, and `equal` must take two key_t values and return whether they
+// are equal.
+//
+//     BHASH_DEFINE(points, uint64_t, struct point, bhash_hash_int, bhash_equal_int)
+//     points_t map = {0};
+//     points_set(&map, 42, (struct point){1, 2});
+//     struct point *p = points_get(&map, 42);
+//     points_free(&map);
+//
+// Allocation uses BHASH_CALLOC/BHASH_FREE, which may be defined before
+// including this header (the defaults are calloc and free).
+//
+// Unlike hashmap_t, these maps index their entries with 32 bits, which keeps
+// small entries small: a map of uint32_t to uint32_t packs each entry into 16
+// bytes, where a pointer-sized link would take 24. The price is a limit of
+// 2^30 slots, after which insertions fail as if memory had run out; use
+// hashmap_t for bigger tables. bhash::map in bhash.hpp has the same limit and
+// throws std::length_error when it is reached.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef BHASH_CALLOC
+#define BHASH_CALLOC calloc
+#endif
+#ifndef BHASH_FREE
+#define BHASH_FREE free
+#endif
+
+// Hash and equality functions for common key types
+static inline size_t bhash_hash_int(uint64_t x)
+{
+    x *= 0x9E3779B97F4A7C15u;
+    return (size_t)(x ^ (x >> 32));
+}
+
+static inline bool bhash_equal_int(uint64_t a, uint64_t b) { return a == b; }
+
+static inline size_t bhash_hash_str(const char *str)
+{
+    // FNV-1a, folded so the high bits affect the slot
+    uint64_t h = 0xCBF29CE484222325u;
+    for (; *str; str++) {
+        h ^= (unsigned char)*str;
+        h *= 0x100000001B3u;
+    }
+    return (size_t)(h ^ (h >> 32));
+}
+
+static inline bool bhash_equal_str(const char *a, const char *b) { return strcmp(a, b) == 0; }
+
+#define BHASH_DEFINE(name, key_t, value_t, hash, equal) \
+typedef struct { \
+    key_t key; \
+    value_t value; \
+    int32_t next; /* Offset to the next entry in the chain (0 for the end) */ \
+    bool used; \
+} name##_entry_t; \
+\
+typedef struct { \
+    name##_entry_t *entries; \
+    int capacity, count; \
+    int lastfree; /* Entries at or above this index are known to be in use */ \
+} name##_t; \
+\
+static inline int name##_main_index(const name##_t *h, key_t key) \
+{ \
+    return (int)((size_t)(hash(key)) & (size_t)(h->capacity - 1)); \
+} \
+\
+static inline name##_entry_t *name##_next_entry(name##_entry_t *e) \
+{ \
+    return e->next ? e + e->next : NULL; \
+} \
+\
+static inline void name##_link(name##_entry_t *e, name##_entry_t *next) \
+{ \
+    e->next = next ? (int32_t)(next - e) : 0; \
+} \
+\
+static inline name##_entry_t *name##_find(const name##_t *h, key_t key) \
+{ \
+    if (h->capacity == 0) return NULL; \
+    for (name##_entry_t *e = &h->entries[name##_main_index(h, key)]; e && e->used; e = name##_next_entry(e)) { \
+        if (equal(e->key, key)) return e; \
+    } \
+    return NULL; \
+} \
+\
+/* Return a pointer to the value for `key`, or NULL if it is not present */ \
+static inline value_t *name##_get(const name##_t *h, key_t key) \
+{ \
+    name##_entry_t *e = name##_find(h, key); \
+    return e ? &e->value : NULL; \
+} \
+\
+__attribute__((unused)) static bool name##_resize(name##_t *h, int new_capacity); \
+\
+static inline name##_entry_t *name##_occupy(name##_t *h, name##_entry_t *e, key_t key, bool *inserted) \
+{ \
+    e->key = key; \
+    memset(&e->value, 0, sizeof(value_t)); \
+    e->used = true; \
+    ++h->count; \
+    if (inserted) *inserted = true; \
+    return e; \
+} \
+\
+/* Find the entry for `key`, or insert one (with its value zeroed) if it is \
+   not present. Returns NULL if memory runs out or the table is at its size \
+   limit. */ \
+__attribute__((unused)) static name##_entry_t *name##_claim(name##_t *h, key_t key, bool *inserted) \
+{ \
+    if (inserted) *inserted = false; \
+    if (h->capacity == 0 && !name##_resize(h, 16)) return NULL; \
+    for (;;) { \
+        int i = name##_main_index(h, key); \
+        name##_entry_t *collision = &h->entries[i]; \
+        if (!collision->used) { /* Found empty slot */ \
+            collision->next = 0; \
+            return name##_occupy(h, collision, key, inserted); \
+        } \
+        int i2 = name##_main_index(h, collision->key); \
+        if (i2 == i) { /* Hit a node in the correct place */ \
+            for (name##_entry_t *e = collision; e; e = name##_next_entry(e)) \
+                if (equal(e->key, key)) return e; \
+        } \
+        /* Find a free space, wrapping around to reuse removed entries' slots \
+           while the table is less than 3/4 full */ \
+        while (h->lastfree > 0 && h->entries[h->lastfree-1].used) \
+            --h->lastfree; \
+        if (h->lastfree == 0 && h->count < h->capacity - h->capacity/4) { \
+            h->lastfree = h->capacity; \
+            while (h->entries[h->lastfree-1].used) \
+                --h->lastfree; \
+        } \
+        if (h->lastfree == 0) { /* No spaces left, gotta resize and try again */ \
+            if (h->capacity > INT32_MAX/2 || !name##_resize(h, 2*h->capacity)) return NULL; \
+            continue; \
+        } \
+        name##_entry_t *e = &h->entries[h->lastfree-1]; \
+        if (i2 == i) { \
+            /* Put new node between the colliding node and the second node in the chain */ \
+            name##_link(e, name##_next_entry(collision)); \
+            name##_link(collision, e); \
+        } else { \
+            /* Hit the middle of a chain for some other hash value: \
+               scootch the collider to the free space and take its slot */ \
+            name##_entry_t *prev = &h->entries[i2]; \
+            while (name##_next_entry(prev) != collision) \
+                prev = name##_next_entry(prev); \
+            *e = *collision; \
+            name##_link(e, name##_next_entry(collision)); \
+            name##_link(prev, e); \
+            e = collision; \
+            e->next = 0; \
+        } \
+        return name##_occupy(h, e, key, inserted); \
+    } \
+} \
+\
+__attribute__((unused)) static bool name##_resize(name##_t *h, int new_capacity) \
+{ \
+    name##_t old = *h; \
+    h->entries = BHASH_CALLOC((size_t)new_capacity, sizeof(name##_entry_t)); \
+    if (!h->entries) { \
+        *h = old; \
+        return false; \
+    } \
+    h->capacity = h->lastfree = new_capacity; \
+    h->count = 0; \
+    for (int i = 0; i < old.capacity; i++) { \
+        if (!old.entries[i].used) continue; \
+        /* The new table has room for every entry, so this can't fail */ \
+        name##_entry_t *e = name##_claim(h, old.entries[i].key, NULL); \
+        if (e) e->value = old.entries[i].value; \
+    } \
+    if (old.entries) BHASH_FREE(old.entries); \
+    return true; \
+} \
+\
+/* Return a pointer to the value for `key`, inserting a zeroed value if the \
+   key is new, or NULL if memory runs out */ \
+static inline value_t *name##_put(name##_t *h, key_t key, bool *inserted) \
+{ \
+    name##_entry_t *e = name##_claim(h, key, inserted); \
+    return e ? &e->value : NULL; \
+} \
+\
+/* Insert or update a value. Returns false if memory runs out. */ \
+static inline bool name##_set(name##_t *h, key_t key, value_t value) \
+{ \
+    name##_entry_t *e = name##_claim(h, key, NULL); \
+    if (!e) return false; \
+    e->value = value; \
+    return true; \
+} \
+\
+/* Remove `key` and free its slot for reuse. Returns false if it was not present. */ \
+__attribute__((unused)) static bool name##_remove(name##_t *h, key_t key) \
+{ \
+    name##_entry_t *e = name##_find(h, key); \
+    if (!e) return false; \
+    name##_entry_t *head = &h->entries[name##_main_index(h, key)], *freed = e; \
+    if (e == head) { /* Chain head: pull the second node up into this slot */ \
+        if (e->next) { \
+            freed = name##_next_entry(e); \
+            e->key = freed->key; \
+            e->value = freed->value; \
+            name##_link(e, name##_next_entry(freed)); \
+        } \
+    } else { \
+        name##_entry_t *prev = head; \
+        while (name##_next_entry(prev) != e) \
+            prev = name##_next_entry(prev); \
+        name##_link(prev, name##_next_entry(e)); \
+    } \
+    memset(freed, 0, sizeof(name##_entry_t)); \
+    h->lastfree = (int)(freed - h->entries) + 1; \
+    --h->count; \
+    return true; \
+} \
+\
+/* Iterate over entries: pass NULL to get the first entry, and the previous \
+   entry to get the next one. Returns NULL after the last entry. */ \
+static inline name##_entry_t *name##_next(const name##_t *h, const name##_entry_t *prev) \
+{ \
+    if (h->capacity == 0) return NULL; \
+    name##_entry_t *e = prev ? &h->entries[prev - h->entries + 1] : h->entries; \
+    for (; e < &h->entries[h->capacity]; e++) \
+        if (e->used) return e; \
+    return NULL; \
+} \
+\
+/* Remove every entry, keeping the memory for reuse */ \
+static inline void name##_clear(name##_t *h) \
+{ \
+    if (h->entries) memset(h->entries, 0, (size_t)h->capacity*sizeof(name##_entry_t)); \
+    h->count = 0; \
+    h->lastfree = h->capacity; \
+} \
+\
+static inline void name##_free(name##_t *h) \
+{ \
+    if (h->entries) BHASH_FREE(h->entries); \
+    memset(h, 0, sizeof(name##_t)); \
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1
@@ -0,0 +1,224 @@
+// bytehash.c - Hashing for byte-string keys
+// Copyright 2022 Bruce Hill
+// Provided under the MIT license with the Commons Clause
+// See included LICENSE for details.
+
+// There are three implementations of bhash_hash_bytes(), and the fastest one
+// the CPU supports is picked when the library is loaded:
+//   - "aes": AES-NI rounds, 32 bytes per step in two independent lanes
+//   - "crc32c": the SSE4.2 CRC32 instruction on two 64-bit lanes, with a
+//     multiply-and-fold finalizer (CRC on its own mixes poorly)
+//   - "portable": a wyhash-style multiply-and-fold hash for any CPU
+// They give different hashes for the same input, so hashes should never be
+// saved or sent between processes. None of them are meant to resist
+// deliberately colliding keys.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bhash.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BHASH_X86
+#include <immintrin.h>
+#endif
+
+#ifdef __SIZEOF_INT128__
+__extension__ typedef unsigned __int128 uint128_t;
+#endif
+
+#define SEED 0x243F6A8885A308D3u
+#define P0 0xA0761D6478BD642Fu
+#define P1 0xE7037ED1A0B428DBu
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+static inline uint64_t read32(const unsigned char *p)
+{
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+// Load a key of 0-16 bytes into two words, without reading past the end
+static inline void read_short(const unsigned char *p, size_t len, uint64_t *a, uint64_t *b)
+{
+    if (len >= 4) {
+        size_t mid = (len >> 3) << 2;
+        *a = (read32(p) << 32) | read32(p + mid);
+        *b = (read32(p + len - 4) << 32) | read32(p + len - 4 - mid);
+    } else if (len > 0) {
+        *a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+        *b = 0;
+    } else {
+        *a = *b = 0;
+    }
+}
+
+// 64x64 -> 128 bit multiply, folded back down to 64 bits
+static inline uint64_t mum(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    uint128_t r = (uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t ha = a >> 32, la = (uint32_t)a, hb = b >> 32, lb = (uint32_t)b;
+    uint64_t rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb, t = rl + (rm0 << 32);
+    uint64_t lo = t + (rm1 << 32);
+    uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl) + (lo < t);
+    return lo ^ hi;
+#endif
+}
+
+static uint64_t hash_portable(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t seed = SEED ^ mum(SEED ^ P0, (uint64_t)len ^ P1), a, b;
+    if (len <= 16) {
+        read_short(p, len, &a, &b);
+    } else {
+        size_t i = len;
+        if (i > 48) { // Three independent lanes for long keys
+            uint64_t s1 = seed, s2 = seed;
+            do {
+                seed = mum(read64(p) ^ P0, read64(p + 8) ^ seed);
+                s1 = mum(read64(p + 16) ^ P1, read64(p + 24) ^ s1);
+                s2 = mum(read64(p + 32) ^ P0, read64(p + 40) ^ s2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= s1 ^ s2;
+        }
+        for (; i > 16; i -= 16, p += 16)
+            seed = mum(read64(p) ^ P0, read64(p + 8) ^ seed);
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+    return mum(P0 ^ len, mum(a ^ P0, b ^ seed));
+}
+
+#ifdef BHASH_X86
+__attribute__((target("sse4.2")))
+static uint64_t hash_crc32c(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t c0 = (uint32_t)SEED, c1 = (uint32_t)(SEED >> 32), a, b;
+    if (len <= 16) {
+        read_short(p, len, &a, &b);
+    } else {
+        size_t i = len;
+        for (; i > 16; i -= 16, p += 16) {
+            c0 = _mm_crc32_u64(c0, read64(p));
+            c1 = _mm_crc32_u64(c1, read64(p + 8));
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+    c0 = _mm_crc32_u64(c0, a);
+    c1 = _mm_crc32_u64(c1, b ^ len);
+    // CRC is linear, so finish with a nonlinear mix of both lanes
+    return mum((c0 << 32 | c1) ^ P0, a ^ b ^ P1 ^ len);
+}
+
+__attribute__((target("aes,sse4.2")))
+static inline __m128i load128(const unsigned char *p)
+{
+    __m128i v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+__attribute__((target("aes,sse4.2")))
+static uint64_t hash_aes(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    __m128i key = _mm_set_epi64x((int64_t)P1, (int64_t)(SEED ^ len));
+    __m128i s0 = key, s1 = _mm_xor_si128(key, _mm_set_epi64x((int64_t)P0, (int64_t)P1)), tail;
+    if (len < 16) {
+        uint64_t a, b;
+        read_short(p, len, &a, &b);
+        tail = _mm_set_epi64x((int64_t)b, (int64_t)a);
+    } else {
+        size_t i = len;
+        for (; i > 32; i -= 32, p += 32) {
+            s0 = _mm_aesenc_si128(_mm_xor_si128(s0, load128(p)), key);
+            s1 = _mm_aesenc_si128(_mm_xor_si128(s1, load128(p + 16)), key);
+        }
+        if (i > 16) {
+            s1 = _mm_aesenc_si128(_mm_xor_si128(s1, load128(p)), key);
+            p += i - 16;
+        } else {
+            p += i - 16;
+        }
+        tail = load128(p);
+    }
+    s0 = _mm_aesenc_si128(_mm_xor_si128(s0, tail), key);
+    s0 = _mm_aesenc_si128(s0, s1);
+    s0 = _mm_aesenc_si128(s0, key);
+    s0 = _mm_aesenc_si128(s0, key);
+    return (uint64_t)_mm_cvtsi128_si64(s0) ^ (uint64_t)_mm_extract_epi64(s0, 1);
+}
+#endif
+
+static const struct {
+    const char *name;
+    uint64_t (*hash)(const void *data, size_t len);
+} hashers[] = {
+#ifdef BHASH_X86
+    {"aes", hash_aes},
+    {"crc32c", hash_crc32c},
+#endif
+    {"portable", hash_portable},
+};
+
+// Index into hashers[]. Other threads may be hashing while it is switched, so
+// it is only accessed atomically. Relaxed ordering is enough, since hashers[]
+// is constant and the switch doesn't order anything else.
+static size_t current_hasher = sizeof(hashers)/sizeof(hashers[0]) - 1;
+
+static bool cpu_supports(const char *name)
+{
+#ifdef BHASH_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "aes") == 0) return __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse4.2");
+    if (strcmp(name, "crc32c") == 0) return __builtin_cpu_supports("sse4.2");
+#endif
+    return strcmp(name, "portable") == 0;
+}
+
+bool bhash_use_byte_hasher(const char *name)
+{
+    for (size_t i = 0; i < sizeof(hashers)/sizeof(hashers[0]); i++) {
+        if ((name == NULL || strcmp(name, hashers[i].name) == 0) && cpu_supports(hashers[i].name)) {
+            __atomic_store_n(&current_hasher, i, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Pick the first (fastest) supported hasher when the library is loaded
+__attribute__((constructor))
+static void choose_byte_hasher(void)
+{
+    (void)bhash_use_byte_hasher(NULL);
+}
+
+const char *bhash_byte_hasher(void)
+{
+    return hashers[__atomic_load_n(&current_hasher, __ATOMIC_RELAXED)].name;
+}
+
+uint64_t bhash_hash_bytes(const void *data, size_t len)
+{
+    return hashers[__atomic_load_n(&current_hasher, __ATOMIC_RELAXED)].hash(data, len);
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1
@@ -0,0 +1,253 @@
+// compare.cpp - Compare hashmap_t with std::unordered_map and a linear-probing table
+// Compile with `make compare` and run `./compare [-f csv|json] [-n keys] [distribution...]`
+// (default: CSV, 1M keys, every distribution in bench_keys.h)
+//
+// All three maps get the same pointer keys, the same hash function
+// (bhash_hash_pointer), and the same sequence of operations, so the
+// differences come from the table designs. Results are written one row per
+// measurement, for plotting or tracking over time.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include "bhash.h"
+}
+#include "bench_keys.h"
+
+struct pointer_hash {
+    size_t operator()(const void *p) const { return bhash_hash_pointer(p); }
+};
+
+// A minimal open-addressing table for reference: keys and values in one flat
+// array of 16-byte slots, linear probing, at most 3/4 full, and backward-shift
+// deletion so there are no tombstones. NULL keys mark empty slots. Linear
+// probing turns runs of adjacent hash values into one long probe sequence
+// (sequential keys would make it quadratic), so like most such tables it
+// spreads the hash over the slots with a Fibonacci multiply first.
+class linear_map {
+    struct slot {
+        const void *key;
+        const void *value;
+    };
+    std::vector<slot> slots;
+    size_t count = 0, mask = 0;
+    int shift = 64;
+
+    size_t home(const void *key) const {
+        return (size_t)(((uint64_t)pointer_hash()(key) * 0x9E3779B97F4A7C15u) >> shift) & mask;
+    }
+
+    void grow() {
+        std::vector<slot> old(slots.empty() ? 16 : 2*slots.size());
+        old.swap(slots);
+        mask = slots.size() - 1;
+        for (shift = 64; ((size_t)1 << (64 - shift)) < slots.size(); --shift) continue;
+        count = 0;
+        for (const slot &s : old)
+            if (s.key) insert(s.key, s.value);
+    }
+
+public:
+    void insert(const void *key, const void *value) {
+        if (4*(count + 1) > 3*slots.size()) grow();
+        size_t i = home(key);
+        for (; slots[i].key; i = (i + 1) & mask) {
+            if (slots[i].key == key) {
+                slots[i].value = value;
+                return;
+            }
+        }
+        slots[i] = {key, value};
+        ++count;
+    }
+
+    const void *find(const void *key) const {
+        if (slots.empty()) return nullptr;
+        for (size_t i = home(key); slots[i].key; i = (i + 1) & mask)
+            if (slots[i].key == key) return slots[i].value;
+        return nullptr;
+    }
+
+    void erase(const void *key) {
+        if (slots.empty()) return;
+        size_t i = home(key);
+        for (; slots[i].key != key; i = (i + 1) & mask)
+            if (!slots[i].key) return;
+        // Shift later entries of the probe run back into the hole, unless
+        // that would move them before their home slot
+        for (size_t j = (i + 1) & mask; slots[j].key; j = (j + 1) & mask) {
+            if (((j - home(slots[j].key)) & mask) >= ((j - i) & mask)) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i] = {nullptr, nullptr};
+        --count;
+    }
+
+    template <class Fn> void for_each(Fn fn) const {
+        for (const slot &s : slots)
+            if (s.key) fn(s.key);
+    }
+};
+
+// A uniform interface over the three maps
+struct bhash_c {
+    static constexpr const char *name = "hashmap_t";
+    mutable hashmap_t h = HASHMAP_INIT; // Embedded, like the other maps' headers
+    ~bhash_c() { hashmap_destroy(&h); }
+    void insert(const void *k, const void *v) { (void)hashmap_set(&h, k, v); }
+    const void *find(const void *k) const { return hashmap_get(&h, k); }
+    void erase(const void *k) { (void)hashmap_set(&h, k, nullptr); }
+    template <class Fn> void for_each(Fn fn) const {
+        for (const void *k = nullptr; (k = hashmap_next(&h, k)); ) fn(k);
+    }
+};
+
+struct std_map {
+    static constexpr const char *name = "std::unordered_map";
+    std::unordered_map<const void*, const void*, pointer_hash> m;
+    void insert(const void *k, const void *v) { m[k] = v; }
+    const void *find(const void *k) const {
+        auto it = m.find(k);
+        return it == m.end() ? nullptr : it->second;
+    }
+    void erase(const void *k) { m.erase(k); }
+    template <class Fn> void for_each(Fn fn) const {
+        for (const auto &kv : m) fn(kv.first);
+    }
+};
+
+struct linear {
+    static constexpr const char *name = "linear probing";
+    linear_map m;
+    void insert(const void *k, const void *v) { m.insert(k, v); }
+    const void *find(const void *k) const { return m.find(k); }
+    void erase(const void *k) { m.erase(k); }
+    template <class Fn> void for_each(Fn fn) const { m.for_each(fn); }
+};
+
+//////////////////////////////////////////////////////
+////////////////      Output      ////////////////////
+//////////////////////////////////////////////////////
+
+static bool json = false;
+static size_t rows = 0;
+
+static double now(void)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void result(const char *distribution, const char *map, const char *op, size_t ops, double secs)
+{
+    double ns = secs*1e9/(double)ops;
+    if (json) {
+        printf("%s\n  {\"distribution\": \"%s\", \"map\": \"%s\", \"op\": \"%s\", \"ops\": %zu, "
+               "\"ns_per_op\": %.3f, \"mops_per_s\": %.3f}", rows ? "," : "[", distribution, map, op, ops, ns,
+               1e3/ns);
+    } else {
+        if (rows == 0) printf("distribution,map,op,ops,ns_per_op,mops_per_s\n");
+        printf("%s,%s,%s,%zu,%.3f,%.3f\n", distribution, map, op, ops, ns, 1e3/ns);
+    }
+    ++rows;
+}
+
+// Keep the optimizer from discarding lookups
+static volatile size_t sink;
+
+// Insert the first half of the keys, look them all up in random order and in
+// a Zipf-skewed order, look up the second half (which are missing), iterate,
+// then erase everything
+template <class Map>
+static void run(const char *distribution, const keyset_t *ks, const std::vector<size_t> &order,
+                const size_t *zipf)
+{
+    size_t n = ks->n/2, found = 0;
+    Map map;
+    double start = now();
+    for (size_t i = 0; i < n; i++)
+        map.insert(ks->keys[i], ks->keys[i]);
+    result(distribution, Map::name, "insert", n, now() - start);
+
+    start = now();
+    for (size_t i : order)
+        found += map.find(ks->keys[i]) != nullptr;
+    result(distribution, Map::name, "lookup_hit", n, now() - start);
+
+    start = now();
+    for (size_t i = 0; i < n; i++)
+        found += map.find(ks->keys[zipf[i]]) != nullptr;
+    result(distribution, Map::name, "lookup_zipf", n, now() - start);
+
+    start = now();
+    for (size_t i : order)
+        found += map.find(ks->keys[n + i]) != nullptr;
+    result(distribution, Map::name, "lookup_miss", n, now() - start);
+
+    start = now();
+    map.for_each([&](const void *) { ++found; });
+    result(distribution, Map::name, "iterate", n, now() - start);
+
+    start = now();
+    for (size_t i : order)
+        map.erase(ks->keys[i]);
+    result(distribution, Map::name, "erase", n, now() - start);
+    map.for_each([&](const void *) { ++found; }); // Should find nothing
+
+    if (found != 3*n) fprintf(stderr, "Error: %s found %zu of %zu keys\n", Map::name, found, 3*n);
+    sink = found;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = 1000000;
+    for (int opt; (opt = getopt(argc, argv, "f:n:")) != -1; ) {
+        if (opt == 'f' && (strcmp(optarg, "csv") == 0 || strcmp(optarg, "json") == 0)) {
+            json = strcmp(optarg, "json") == 0;
+        } else if (opt == 'n' && atol(optarg) > 0) {
+            n = (size_t)atol(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-f csv|json] [-n keys] [distribution...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    uint64_t state = 0x9E3779B97F4A7C15u;
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++)
+        order[i] = i;
+    for (size_t i = n - 1; i > 0; i--)
+        std::swap(order[i], order[keys_rng(&state) % (i + 1)]);
+    size_t *zipf = zipf_trace(n, 0.99, n, &state);
+    if (!zipf) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    for (int d = 0; d < NUM_KEY_DISTRIBUTIONS; d++) {
+        bool selected = (optind >= argc);
+        for (int a = optind; a < argc; a++)
+            selected |= strcmp(argv[a], key_distribution_names[d]) == 0;
+        if (!selected) continue;
+        keyset_t ks;
+        if (!keyset_init(&ks, (key_distribution_t)d, 2*n, keys_rng(&state))) {
+            fprintf(stderr, "Error: out of memory\n");
+            return 1;
+        }
+        run<bhash_c>(key_distribution_names[d], &ks, order, zipf);
+        run<std_map>(key_distribution_names[d], &ks, order, zipf);
+        run<linear>(key_distribution_names[d], &ks, order, zipf);
+        keyset_free(&ks);
+    }
+    if (json) printf("%s\n", rows ? "\n]" : "[]");
+    free(zipf);
+    return 0;
+}
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1
@@ -0,0 +1,141 @@
+// mph.h - Minimal perfect hashing used by hashmap_freeze() and bhash-gen
+// Copyright 2022 Bruce Hill
+// Provided under the MIT license with the Commons Clause
+// See included LICENSE for details.
+
+// This is a CHD/PTHash style construction: each 64-bit key hash picks one of
+// mph_num_buckets(n) buckets, and each bucket gets a pilot value chosen so that
+// all of its keys land in distinct slots in [0,n). Buckets with a single key
+// store that key's slot directly instead of a pilot.
+// Internal header: not installed with the library.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MPH_DIRECT_PILOT 0x80000000u
+// Average number of keys per bucket
+#define MPH_BUCKET_SIZE 3
+// Largest bucket the builder will try to place with a single pilot
+#define MPH_MAX_BUCKET 64
+
+static inline uint64_t mph_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9u;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBu;
+    x ^= x >> 31;
+    return x;
+}
+
+// Map a 32-bit hash uniformly onto [0,n) without a division
+static inline uint32_t mph_reduce(uint32_t x, uint32_t n)
+{
+    return (uint32_t)(((uint64_t)x * n) >> 32);
+}
+
+static inline uint32_t mph_num_buckets(uint32_t n)
+{
+    return n/MPH_BUCKET_SIZE + 1;
+}
+
+static inline uint32_t mph_bucket(uint64_t hash, uint32_t num_buckets)
+{
+    return mph_reduce((uint32_t)(hash >> 32), num_buckets);
+}
+
+static inline uint32_t mph_slot(uint64_t hash, uint32_t pilot, uint32_t n)
+{
+    if (pilot & MPH_DIRECT_PILOT) return pilot & ~MPH_DIRECT_PILOT;
+    return mph_reduce((uint32_t)mph_mix(hash ^ ((uint64_t)pilot * 0x9E3779B97F4A7C15u)), n);
+}
+
+// Choose a pilot for each of the mph_num_buckets(n) buckets and store the slot
+// for each key in `slots`. Fails if memory runs out or two keys share a hash.
+static bool mph_build(const uint64_t *hashes, uint32_t n, uint32_t *pilots, uint32_t *slots)
+{
+    uint32_t num_buckets = mph_num_buckets(n);
+    // Scratch space: keys sorted by bucket, bucket start offsets, buckets
+    // sorted by size, and which slots are taken
+    char *scratch = calloc((size_t)(n + 2*num_buckets + 1)*sizeof(uint32_t) + n, 1);
+    if (!scratch) return false;
+    uint32_t *keys_by_bucket = (uint32_t*)(void*)scratch;
+    uint32_t *bucket_start = &keys_by_bucket[n];
+    uint32_t *buckets_by_size = &bucket_start[num_buckets + 1];
+    bool *taken = (bool*)&buckets_by_size[num_buckets];
+
+    // Counting sort the keys by bucket
+    for (uint32_t k = 0; k < n; k++)
+        ++bucket_start[mph_bucket(hashes[k], num_buckets) + 1];
+    uint32_t by_size[MPH_MAX_BUCKET + 2] = {0};
+    for (uint32_t b = 0; b < num_buckets; b++) {
+        uint32_t size = bucket_start[b+1];
+        if (size > MPH_MAX_BUCKET) {
+            free(scratch);
+            return false;
+        }
+        ++by_size[MPH_MAX_BUCKET - size + 1];
+        bucket_start[b+1] += bucket_start[b];
+    }
+    memcpy(pilots, bucket_start, num_buckets*sizeof(uint32_t)); // Borrowed as fill pointers
+    for (uint32_t k = 0; k < n; k++)
+        keys_by_bucket[pilots[mph_bucket(hashes[k], num_buckets)]++] = k;
+
+    // Place the biggest buckets first, while the table is mostly empty
+    for (uint32_t size = 0; size <= MPH_MAX_BUCKET; size++)
+        by_size[size+1] += by_size[size];
+    for (uint32_t b = 0; b < num_buckets; b++)
+        buckets_by_size[by_size[MPH_MAX_BUCKET - (bucket_start[b+1] - bucket_start[b])]++] = b;
+
+    bool ok = true;
+    uint32_t next_free = 0;
+    for (uint32_t i = 0; i < num_buckets && ok; i++) {
+        uint32_t b = buckets_by_size[i];
+        uint32_t *keys = &keys_by_bucket[bucket_start[b]];
+        uint32_t size = bucket_start[b+1] - bucket_start[b];
+        pilots[b] = 0;
+        if (size == 0) continue;
+
+        if (size == 1) { // Point straight at a free slot
+            while (taken[next_free]) ++next_free;
+            slots[keys[0]] = next_free;
+            pilots[b] = MPH_DIRECT_PILOT | next_free;
+            taken[next_free] = true;
+            continue;
+        }
+
+        // Keys with identical hashes could never be separated
+        for (uint32_t j = 0; j < size && ok; j++)
+            for (uint32_t j2 = 0; j2 < j && ok; j2++)
+                ok = hashes[keys[j]] != hashes[keys[j2]];
+
+        for (uint32_t pilot = 0; ok; pilot++) {
+            if (pilot == MPH_DIRECT_PILOT) {
+                ok = false;
+                break;
+            }
+            uint32_t j = 0;
+            for (; j < size; j++) {
+                uint32_t slot = mph_slot(hashes[keys[j]], pilot, n);
+                if (taken[slot]) break;
+                taken[slot] = true;
+                slots[keys[j]] = slot;
+            }
+            if (j == size) {
+                pilots[b] = pilot;
+                break;
+            }
+            // Undo the partial placement and try the next pilot
+            while (j-- > 0)
+                taken[slots[keys[j]]] = false;
+        }
+    }
+    free(scratch);
+    return ok;
+}
+
+// vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1